@@ -0,0 +1,143 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+
+/*
+ * There is only one converter so the requests are queued in a bitmask and
+ * the completion IRQ starts the next one. The lowest bit goes first so MAP
+ * always wins over the slow channels.
+ *
+ * MAP is requested from the trigger wheel on a fixed tooth so that we always
+ * sample at the same crank angle. The rest is round-robin from the management
+ * thread.
+ *
+ * Each channel is filtered with a simple IIR:
+ *	acc = acc - acc/2^n + raw  ==> value = acc/2^n
+ * The raw value is 10 bit so n <= 6 fits in an unsigned short.
+ */
+static const unsigned char filter_shift[ADC_CHANNEL_NR] = {
+	[ADC_MAP] = 1,
+	[ADC_EGO] = 1,
+	[ADC_TPS] = 1,
+	[ADC_CLT] = 4,
+	[ADC_IAT] = 4,
+	[ADC_BAT] = 3,
+};
+
+/*
+ * The value is published with a sequence counter since an unsigned short
+ * is not atomic on 8 bit. Odd means an update is in progress.
+ */
+struct adc_value{
+	volatile unsigned char seq;
+	volatile unsigned short val;
+};
+
+static struct adc_value adc_value[ADC_CHANNEL_NR];
+static unsigned short acc[ADC_CHANNEL_NR];
+static volatile unsigned char pending, busy, slow;
+
+#define ADC_IDLE 0xff
+#define barrier() __asm__ __volatile__("": : :"memory")
+
+/* Called with IRQ disabled */
+static void adc_start_next(void)
+{
+	unsigned char ch;
+
+	busy = ADC_IDLE;
+	for(ch=0; ch<ADC_CHANNEL_NR; ch++){
+		if(!(pending & (1<<ch)))
+			continue;
+		pending &= ~(1<<ch);
+		if(adc_start_platform(ch) < 0) /* Not wired on this platform */
+			continue;
+		busy = ch;
+		return;
+	}
+}
+
+void adc_request(int ch)
+{
+	OS_CPU_SR cpu_sr;
+
+	OS_ENTER_CRITICAL();
+	pending |= (1<<ch);
+	if(busy == ADC_IDLE)
+		adc_start_next();
+	OS_EXIT_CRITICAL();
+}
+
+/* Round-robin over the slow channels */
+void adc_request_slow(void)
+{
+	if(slow < ADC_TPS || slow >= ADC_CHANNEL_NR - 1)
+		slow = ADC_TPS;
+	else
+		slow++;
+	adc_request(slow);
+}
+
+/*
+ * Conversion done; Called from IRQ context
+ */
+void adc_complete(unsigned short raw)
+{
+	unsigned char ch = busy, n;
+	struct adc_value *v;
+
+	if(ch == ADC_IDLE)
+		return;
+
+	n = filter_shift[ch];
+	acc[ch] = acc[ch] - (acc[ch] >> n) + raw;
+
+	v = &adc_value[ch];
+	v->seq++;
+	barrier();
+	v->val = acc[ch] >> n;
+	barrier();
+	v->seq++;
+
+	adc_start_next();
+}
+
+/*
+ * Lock free read; retry if the IRQ came in while we were reading
+ */
+unsigned short adc_get(int ch)
+{
+	unsigned char s;
+	unsigned short val;
+	struct adc_value *v = &adc_value[ch];
+
+	do{
+		s = v->seq;
+		barrier();
+		val = v->val;
+		barrier();
+	}while( (s & 1) || (s != v->seq) );
+	return val;
+}
+
+void adc_init(void)
+{
+	memset(adc_value, 0, sizeof(adc_value));
+	memset(acc, 0, sizeof(acc));
+	pending = 0;
+	busy = ADC_IDLE;
+	slow = ADC_MAP;
+	adc_init_platform();
+}
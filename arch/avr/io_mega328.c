@@ -13,42 +13,8 @@
  * limitations under the License.
  */
 #include <ecu.h>
-#include <limits.h>
-
-/******************************************************************************/
-/* IO MAPPING 328 */
-/******************************************************************************/
-/* 
- *
- *								PORTB
- * 					0,  1,  2,  3,  4,  5,  6,  7
- *  Digital PIN:	8,  9,  10, 11, 12, 13  NC  NC XTAL
- *  ISP PIN:					XX, XX, XX
- *  CRANK:			#								INPUT
- *  CAM:				#							INPUT
- *  RELAY:					#						B+ Injectors, COIL
- *
- *								PORTC
- * 					0,  1,  2,  3,  4,  5,  6,  7
- *  Analog  PIN:	0,  1,  2,  3,  4,  5,  NC  NC RESET
- *     OR
- *  Digital PIN:   A0, A1, A2, A3, A4, A5,
- *  RELAY GAZ       #
- *  COIL1:						#
- *  COIL2:					#
- *  COIL3:				#
- *  COIL4:							#
- *
- *								PORTD
- * 					0,  1,  2,  3,  4,  5,  6,  7
- *  Digital PIN:	0,  1,  2,  3,  4,  5,  6,  7
- *  UART		    XX XX
- *  INJ1:					#
- *  INJ2:						#
- *  INJ3:							#
- *  INJ4:								#
- *  STARTER:								#
- */
+#include <avr/eeprom.h>
+#include <io.h>
 
 /******************************************************************************/
 /* Input */
@@ -61,226 +27,182 @@
 //#define CAM_VAL() (PINB & _BV(DDB1))
 
 /******************************************************************************/
-/* Output */
+/* Timebase */
 /******************************************************************************/
-#define CFG_OUTPUT() do { \
-    DDRD |= _BV(DDD2); \
-    DDRD |= _BV(DDD3); \
-    DDRD |= _BV(DDD4); \
-    DDRD |= _BV(DDD5); \
-    DDRD |= _BV(DDD6); \
-    DDRB |= _BV(DDB2); \
-    DDRC |= _BV(DDC0); \
-    DDRC |= _BV(DDC1); \
-    DDRC |= _BV(DDC2); \
-    DDRC |= _BV(DDC3); \
-    DDRC |= _BV(DDC4); \
-} while(0)
-
-#define INJ1_ON() do {PORTD |= _BV(DDD2) ; } while(0)
-#define INJ1_OFF() do {PORTD &= ~_BV(DDD2) ; } while(0)
-
-#define INJ2_ON() do {PORTD |= _BV(DDD3) ; } while(0)
-#define INJ2_OFF() do {PORTD &= ~_BV(DDD3) ; } while(0)
-
-#define INJ3_ON() do {PORTD |= _BV(DDD4) ; } while(0)
-#define INJ3_OFF() do {PORTD &= ~_BV(DDD4) ; } while(0)
-
-#define INJ4_ON() do {PORTD |= _BV(DDD5) ; } while(0)
-#define INJ4_OFF() do {PORTD &= ~_BV(DDD5) ; } while(0)
-
-#define COIL1_ON() do {PORTC |= _BV(DDC3) ; } while(0)
-#define COIL1_OFF() do {PORTC &= ~_BV(DDC3) ; } while(0)
-
-#define COIL2_ON() do {PORTC |= _BV(DDC2) ; } while(0)
-#define COIL2_OFF() do {PORTC &= ~_BV(DDC2) ; } while(0)
-
-#define COIL3_ON() do {PORTC |= _BV(DDC1) ; } while(0)
-#define COIL3_OFF() do {PORTC &= ~_BV(DDC1) ; } while(0)
-
-#define COIL4_ON() do {PORTC |= _BV(DDC4) ; } while(0)
-#define COIL4_OFF() do {PORTC &= ~_BV(DDC4) ; } while(0)
-
-#define RELAY_ON() do {PORTB &= ~_BV(DDB2) ; } while(0)
-#define RELAY_OFF() do {PORTB |= _BV(DDB2) ; } while(0)
+/*
+ * Timer1 is free running from timer_init() @F_CPU/8 ==> 2 tick per usec.
+ * It is extended to 32 bit on overflow and is the ECU timebase.
+ *
+ * What this takes from the lib:
+ *	- timer_init() starts Timer1 in normal mode @F_CPU/8 and doesn't use
+ *	  its IRQs; The OS tick is on another timer. Timer2 is left alone.
+ *	  The mode and the prescaler are checked at engine start.
+ *	- Every Timer1 vector is ours; An ISR(TIMER1_*) in the lib is a second
+ *	  definition of the same __vector_N and fails the link.
+ *	- F_CPU 16MHz; Checked below.
+ */
+#if F_CPU != 16000000UL
+#error "TICK_PER_USEC assumes Timer1 @F_CPU/8 == 2MHz"
+#endif
 
-#define GAZ_ON() do {PORTC &= ~_BV(DDC0) ; } while(0)
-#define GAZ_OFF() do {PORTC |= _BV(DDC0) ; } while(0)
+#define TIMER1_CS_MASK (_BV(CS12) | _BV(CS11) | _BV(CS10))
+#define TIMER1_WGM_B (_BV(WGM13) | _BV(WGM12))
+#define TIMER1_WGM_A (_BV(WGM11) | _BV(WGM10))
+#define TIMER2_CS_MASK (_BV(CS22) | _BV(CS21) | _BV(CS20))
 
-#define STARTER_ON() do {PORTD &= ~_BV(DDD6) ; } while(0)
-#define STARTER_OFF() do {PORTD |= _BV(DDD6) ; } while(0)
+static volatile unsigned short tick_hi;
 
-/******************************************************************************/
-/* Injector */
-/******************************************************************************/
-void io_open_injector(int inj)
+ISR(TIMER1_OVF_vect)
 {
-	switch(inj){
-	case CYL1:
-		INJ1_ON();
-#ifdef __INJ_TEST__
-		T2 = get_monotonic_time();
-#endif
-		break;
-	case CYL2:
-		INJ2_ON();
-		break;
-	case CYL3:
-		INJ3_ON();
-		break;
-	case CYL4:
-		INJ4_ON();
-		break;
-	default:
-		DIE(FATAL);
-	}
-//	PRINT("INJ ON %d \n", inj);
+	tick_hi++;
 }
 
-void io_close_injector(int inj, unsigned long t)
+unsigned long get_monotonic_tick(void)
 {
-	switch(inj){
-	case CYL1:
-		INJ1_OFF();
-#ifdef __INJ_TEST__
-		INJ_DEBUG = t - T2;
-#endif
-		break;
-	case CYL2:
-		INJ2_OFF();
-		break;
-	case CYL3:
-		INJ3_OFF();
-		break;
-	case CYL4:
-		INJ4_OFF();
-		break;
-	default:
-		DIE(FATAL);
-	}
-//	PRINT("INJ OFF %d \n", inj);
+	unsigned char sreg = SREG;
+	unsigned short hi, lo;
+
+	cli();
+	hi = tick_hi;
+	lo = TCNT1;
+	/* Overflow pending and not serviced yet */
+	if((TIFR1 & _BV(TOV1)) && lo < 0x8000)
+		hi++;
+	SREG = sreg;
+	return ((unsigned long)hi << 16) | lo;
 }
 
 /******************************************************************************/
-/* Coil */
+/* Output compare */
 /******************************************************************************/
-void io_open_coil(int coil, unsigned long t)
+/*
+ * 16 bit compare is ~32msec
+ *
+ * Channel B is the compare of the ECU timer queue. Deadlines that don't fit
+ * in 16 bit are clamped and the queue simply re-arms when it gets there.
+ *
+ * With __HW_OC__ the spark and the injector close edges are done by the
+ * output compare pins so they flip on the exact tick regardless of the IRQ
+ * latency and critical sections. The IRQ only cleans up the select after the fact.
+ *	- Coil on OC1A: Only one coil group is dwelling at any given time
+ *	  so it has a channel of its own.
+ *	- Injector on OC1B: Only when the injector at the head of the timer
+ *	  queue is the only one open since dropping the gate would close all of
+ *	  them. Otherwise the gate stays up and the queue closes it in software.
+ */
+#define OC_MIN_TICK USEC_TO_TICK(10UL) /* Enough margin to program the compare */
+#define OC_MAX_TICK USEC_TO_TICK(30000UL)
+
+#define COM_MASK(a) (_BV(COM1##a##1) | _BV(COM1##a##0))
+#define COM_SET(a) (_BV(COM1##a##1) | _BV(COM1##a##0)) /* Set on match */
+#define COM_CLEAR(a) (_BV(COM1##a##1)) /* Clear on match */
+
+#ifdef __HW_OC__
+static volatile unsigned char oc_coil, inj_open;
+static volatile unsigned short hw_coil_late;
+
+/* Gate high; Set on match so that a stale compare cannot drop it */
+void oc_coil_open(void)
 {
-	switch(coil){
-	case CYL1:
-		COIL1_ON();
-#ifdef __DWELL_TEST__
-		T1 = t;
-#endif
-		break;
-	case CYL2:
-		COIL2_ON();
-		break;
-	case CYL12:
-		COIL1_ON();
-		COIL2_ON();
-		break;
-	case CYL3:
-		COIL3_ON();
-		break;
-	case CYL4:
-		COIL4_ON();
-		break;
-	case CYL34:
-		COIL3_ON();
-		COIL4_ON();
-		break;
-	default:
-		DIE(FATAL);
-	}
-//	PRINT("COIL ON %d \n", coil);
+	unsigned char sreg = SREG;
+	cli();
+	TIMSK1 &= ~_BV(OCIE1A);
+	TCCR1A = (TCCR1A & ~COM_MASK(A)) | COM_SET(A);
+	TCCR1C = _BV(FOC1A);
+	oc_coil = 0;
+	SREG = sreg;
 }
 
-void io_close_coil(int coil, unsigned long t)
+/* Gate high; If someone was waiting on the gate the queue takes over in software */
+void oc_inj_open(int inj)
 {
-	switch(coil){
-	case CYL1:
-		COIL1_OFF();
-#ifdef __DWELL_TEST__
-		DWELL_DEBUG = t - T1;
-#endif
-#ifdef __ADVANCE_TIMING_TEST__
-		T1 = t;
-#endif
-		break;
-	case CYL2:
-		COIL2_OFF();
-		break;
-	case CYL12:
-		COIL1_OFF();
-		COIL2_OFF();
-		break;
-	case CYL3:
-		COIL3_OFF();
-		break;
-	case CYL4:
-		COIL4_OFF();
-		break;
-	case CYL34:
-		COIL3_OFF();
-		COIL4_OFF();
-		break;
-	default:
-		DIE(FATAL);
-	}
-//	PRINT("COIL OFF %d \n", coil);
+	unsigned char sreg = SREG;
+	cli();
+	inj_open |= _BV(inj);
+	TCCR1A = (TCCR1A & ~COM_MASK(B)) | COM_SET(B);
+	TCCR1C = _BV(FOC1B);
+	SREG = sreg;
 }
 
-/******************************************************************************/
-/* Relay */
-/******************************************************************************/
-void io_relay_off(void)
+void oc_inj_close(int inj)
 {
-	RELAY_OFF();
+	unsigned char sreg = SREG;
+	cli();
+	inj_open &= ~_BV(inj);
+	SREG = sreg;
 }
 
-void io_relay_on(void)
+ISR(TIMER1_COMPA_vect)
 {
-	RELAY_ON();
+	unsigned short l = TCNT1 - OCR1A;
+	if(l > hw_coil_late)
+		hw_coil_late = l;
+	TIMSK1 &= ~_BV(OCIE1A);
+	if(oc_coil)
+		io_close_coil(oc_coil, get_monotonic_tick() - l); /* Time of the match */
+	oc_coil = 0;
 }
+#endif
 
-/******************************************************************************/
-/* Starter */
-/******************************************************************************/
-void starter_off(void)
+ISR(TIMER1_COMPB_vect)
 {
-	STARTER_OFF();
+	TIMSK1 &= ~_BV(OCIE1B);
+	timerq_expire();
 }
 
-void starter_on(void)
+void timerq_init_platform(void)
 {
-	STARTER_ON();
+	TIMSK1 &= ~_BV(OCIE1B);
 }
 
-/******************************************************************************/
-/* GAZ Pump */
-/******************************************************************************/
-static int gaz_state = 0;
-void gaz_relay_off(void)
+/* Called with IRQ disabled */
+void timerq_arm_platform(unsigned long deadline, int edge)
 {
-//	PRINT("Gaz OFF\n");
-	GAZ_OFF();
-	gaz_state = 0;
+	unsigned long d = deadline - get_monotonic_tick();
+
+	if((long)d < (long)OC_MIN_TICK)
+		d = OC_MIN_TICK;
+	if(d > OC_MAX_TICK){
+		d = OC_MAX_TICK; /* Come back later */
+		edge = 0;
+	}
+	OCR1B = TCNT1 + (unsigned short)d;
+	TIFR1 = _BV(OCF1B);
+#ifdef __HW_OC__
+	if(edge && inj_open == _BV(edge))
+		TCCR1A = (TCCR1A & ~COM_MASK(B)) | COM_CLEAR(B);
+	else
+		TCCR1A = (TCCR1A & ~COM_MASK(B)) | COM_SET(B);
+#endif
+	TIMSK1 |= _BV(OCIE1B);
 }
 
-void gaz_relay_on(void)
+/* Called with IRQ disabled */
+void io_schedule_close_coil(int coil, unsigned long t)
 {
-//	PRINT("Gaz ON\n");
-	GAZ_ON();
-	gaz_state = 1;
+#ifdef __HW_OC__
+	unsigned long d = t - get_monotonic_tick();
+	if( (long)d >= (long)OC_MIN_TICK && d <= OC_MAX_TICK ){
+		OCR1A = TCNT1 + (unsigned short)d;
+		TIFR1 = _BV(OCF1A);
+		TCCR1A = (TCCR1A & ~COM_MASK(A)) | COM_CLEAR(A);
+		TIMSK1 |= _BV(OCIE1A);
+		oc_coil = coil;
+		return;
+	}
+	/* Out of the compare window; Drop the stale compare, the queue closes it */
+	TIMSK1 &= ~_BV(OCIE1A);
+	TCCR1A = (TCCR1A & ~COM_MASK(A)) | COM_SET(A);
+	oc_coil = 0;
+#endif
+	timerq_add(io_close_coil, coil, t, 0);
 }
 
-void gaz_toggle(void)
+void io_dump(void)
 {
-	if(gaz_state)
-		gaz_relay_off();
-	else
-		gaz_relay_on();
+#ifdef __HW_OC__
+	FORCE_PRINT("HW COIL %u\n", hw_coil_late);
+#endif
 }
 
 /******************************************************************************/
@@ -293,7 +215,7 @@ ISR_NAKED ISR(PCINT0_vect)
 
 	portSAVE_CONTEXT();
 
-	t = get_monotonic_time();
+	t = get_monotonic_tick();
 
 	/* Debounce */
 	for(x=0; x<10; x++)
@@ -306,11 +228,7 @@ ISR_NAKED ISR(PCINT0_vect)
 	if(capture_t) /* Running behind */
 		DIE(IRQ);
 
-	if( (t - curr_time) >= USHRT_MAX )
-		capture_t = 0;
-	else
-		capture_t = (unsigned short)(t - curr_time);
-
+	capture_t = t - curr_time;
 	curr_time = t;
 
 	OSSemPost(engine_event); /* Signal the engine_thread */
@@ -322,8 +240,21 @@ out:
 	__asm__ __volatile__ ( "reti" );
 }
 
+/* Engine thread; timer_init() is done by now */
+static void timer_check(void)
+{
+	/* Timer1: Normal mode @F_CPU/8 */
+	if((TCCR1B & TIMER1_CS_MASK) != _BV(CS11) || (TCCR1B & TIMER1_WGM_B) ||
+		(TCCR1A & TIMER1_WGM_A))
+		DIE(ERROR_INIT);
+	/* Timer2: Still the pump PWM as set by io_init_platform() */
+	if((TCCR2B & TIMER2_CS_MASK) != (_BV(CS22) | _BV(CS21)) || TIMSK2)
+		DIE(ERROR_INIT);
+}
+
 void trigger_wheel_init_platform(void)
 {
+	timer_check();
 	capture_t = 0;
 
 	CFG_INPUT();
@@ -338,28 +269,94 @@ void trigger_wheel_init_platform(void)
 }
 
 /******************************************************************************/
-/* Initialization */
+/* ADC */
+/******************************************************************************/
+#define ADC_NC 0xff
+static const unsigned char adc_mux[ADC_CHANNEL_NR] = {
+	[ADC_MAP] = 6,
+	[ADC_EGO] = 5,
+	[ADC_TPS] = ADC_NC,
+	[ADC_CLT] = 7,
+	[ADC_IAT] = ADC_NC,
+	[ADC_BAT] = ADC_NC,
+};
+
+ISR(ADC_vect)
+{
+	adc_complete(ADC);
+}
+
+void adc_init_platform(void)
+{
+	DIDR0 = _BV(ADC5D);
+	ADMUX = _BV(REFS0); /* AVcc reference */
+	/* Enable with IRQ; 16MHz / 128 = 125KHz ==> ~104usec per conversion */
+	ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+}
+
+int adc_start_platform(int ch)
+{
+	if(adc_mux[ch] == ADC_NC)
+		return -1;
+	ADMUX = _BV(REFS0) | adc_mux[ch];
+	ADCSRA |= _BV(ADSC);
+	return 0;
+}
+
+void adc_stop_platform(void)
+{
+	ADCSRA = 0;
+}
+
+/******************************************************************************/
+/* Fuel pump */
+/******************************************************************************/
+/*
+ * Timer2 fast PWM on OC2A @F_CPU/256/256 ==> ~244Hz
+ * Compare output is disconnected at 0 since fast PWM always has a 1 tick spike.
+ */
+void pump_pwm_platform(unsigned char duty)
+{
+	if(!duty){
+		TCCR2A = _BV(WGM21) | _BV(WGM20);
+		PORTB &= ~_BV(DDB3);
+		return;
+	}
+	OCR2A = duty;
+	TCCR2A = _BV(COM2A1) | _BV(WGM21) | _BV(WGM20);
+}
+
 /******************************************************************************/
-void close_all_io(void)
+/* NVRAM */
+/******************************************************************************/
+void nvram_read(void *dst, int offset, int len)
 {
-	GAZ_OFF();
-	RELAY_OFF();
-	INJ1_OFF();
-	INJ2_OFF();
-	INJ3_OFF();
-	INJ4_OFF();
-	COIL1_OFF();
-	COIL2_OFF();
-	COIL3_OFF();
-	COIL4_OFF();
-	starter_off();
-//	analogDisable();
+	eeprom_read_block(dst, (const void *)offset, len);
 }
 
-void io_init(void)
+/* Doesn't wait for the write to complete; ~3.4msec per byte */
+int nvram_write_byte(int offset, unsigned char b)
 {
-	CFG_OUTPUT();
-	close_all_io();
-//	analogEnable();
+	if(!eeprom_is_ready())
+		return -1;
+	eeprom_update_byte((uint8_t *)offset, b);
+	return 0;
 }
 
+/******************************************************************************/
+/* Initialization */
+/******************************************************************************/
+void io_init_platform(void)
+{
+#ifdef __HW_OC__
+	PORTB &= ~(_BV(DDB1) | _BV(DDB2));
+	DDRB |= _BV(DDB1) | _BV(DDB2);
+#endif
+	TIMSK1 |= _BV(TOIE1); /* Timebase */
+
+	/* Fuel pump PWM; Stopped until the first duty */
+	PORTB &= ~_BV(DDB3);
+	DDRB |= _BV(DDB3);
+	TCCR2A = _BV(WGM21) | _BV(WGM20);
+	TCCR2B = _BV(CS22) | _BV(CS21);
+}
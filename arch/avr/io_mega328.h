@@ -0,0 +1,154 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __IO_MEGA328_H_
+#define __IO_MEGA328_H_
+
+/******************************************************************************/
+/* IO MAPPING 328 */
+/******************************************************************************/
+/* 
+ *
+ *								PORTB
+ * 					0,  1,  2,  3,  4,  5,  6,  7
+ *  Digital PIN:	8,  9,  10, 11, 12, 13  NC  NC XTAL
+ *  ISP PIN:					XX, XX, XX
+ *  CRANK:			#								INPUT
+ *  CAM:				#							INPUT
+ *  RELAY:					#						B+ Injectors, COIL
+ *  PUMP PWM:					#					OC2A; Gaz pump driver, see below
+ *
+ *								PORTC
+ * 					0,  1,  2,  3,  4,  5,  6,  7
+ *  Analog  PIN:	0,  1,  2,  3,  4,  5,  NC  NC RESET
+ *     OR
+ *  Digital PIN:   A0, A1, A2, A3, A4, A5,
+ *  RELAY GAZ       #
+ *  COIL1:						#
+ *  COIL2:					#
+ *  COIL3:				#
+ *  COIL4:							#
+ *
+ *								PORTD
+ * 					0,  1,  2,  3,  4,  5,  6,  7
+ *  Digital PIN:	0,  1,  2,  3,  4,  5,  6,  7
+ *  UART		    XX XX
+ *  INJ1:					#
+ *  INJ2:						#
+ *  INJ3:							#
+ *  INJ4:								#
+ *  STARTER:								#
+ *  RELAY:									#	__HW_OC__ only
+ *
+ *								ADC
+ *  MAP:		ADC6
+ *  CLT:		ADC7
+ *  O2:			ADC5 Wideband controller analog output
+ *  TPS, IAT, BAT:	Not wired; PC0-PC4 are used as output
+ *
+ *						__HW_OC__ Timer1 output compare
+ *  OC1A (PB1):	Coil gate; COILx are AND'ed with it and act as select
+ *  OC1B (PB2):	Injector gate; INJx are AND'ed with it and act as select
+ *  RELAY:		Moves to PD7; The last free pin that isn't ISP
+ *
+ *						ISP
+ * OC2A is the only Timer2 PWM pin left ( OC2B is INJ2 ) and it is MOSI. The
+ * programmer toggles it during ISP and the pump driver follows: Pull the
+ * fuel pump fuse OR unplug the harness before ISP programming.
+ */
+
+/******************************************************************************/
+/* Register accessors */
+/******************************************************************************/
+enum { IO_PORT_B, IO_PORT_C, IO_PORT_D };
+#define IO_FOR_EACH_PORT(X, arg) X(B, arg) X(C, arg) X(D, arg)
+
+#define IO_CFG_OUTPUT(p, m) do { DDR##p |= (m); } while(0)
+
+/*
+ * Plain read-modify-write of PORTx with the IRQ held off for those few
+ * cycles; A bit is changed from the engine thread and from the timer queue
+ * IRQ ( e.g. btdc_0 and the spark deadline both close the coil ) so neither
+ * the PORTx RMW nor a PORTx read / PINx toggle is safe without it. The mask
+ * comes from a table so it can't be a single sbi / cbi. All the bits of a
+ * group still switch on the same cycle.
+ */
+#define IO_PORT_SET(p, m) do { \
+	unsigned char _sreg = SREG; \
+	cli(); \
+	PORT##p |= (m); \
+	SREG = _sreg; \
+} while(0)
+#define IO_PORT_CLR(p, m) do { \
+	unsigned char _sreg = SREG; \
+	cli(); \
+	PORT##p &= ~(m); \
+	SREG = _sreg; \
+} while(0)
+
+/******************************************************************************/
+/* Pin descriptor */
+/******************************************************************************/
+#define INJ1_PORT IO_PORT_D
+#define INJ1_BIT _BV(DDD2)
+#define INJ2_PORT IO_PORT_D
+#define INJ2_BIT _BV(DDD3)
+#define INJ3_PORT IO_PORT_D
+#define INJ3_BIT _BV(DDD4)
+#define INJ4_PORT IO_PORT_D
+#define INJ4_BIT _BV(DDD5)
+
+#define COIL1_PORT IO_PORT_C
+#define COIL1_BIT _BV(DDC3)
+#define COIL2_PORT IO_PORT_C
+#define COIL2_BIT _BV(DDC2)
+#define COIL3_PORT IO_PORT_C
+#define COIL3_BIT _BV(DDC1)
+#define COIL4_PORT IO_PORT_C
+#define COIL4_BIT _BV(DDC4)
+
+#ifdef __HW_OC__
+#define RELAY_PORT IO_PORT_D
+#define RELAY_BIT _BV(DDD7)
+#else
+#define RELAY_PORT IO_PORT_B
+#define RELAY_BIT _BV(DDB2)
+#endif
+#define RELAY_ACTIVE_LOW 1
+
+#define GAZ_PORT IO_PORT_C
+#define GAZ_BIT _BV(DDC0)
+#define GAZ_ACTIVE_LOW 1
+
+#define STARTER_PORT IO_PORT_D
+#define STARTER_BIT _BV(DDD6)
+#define STARTER_ACTIVE_LOW 1
+
+/******************************************************************************/
+/* Output compare hooks */
+/******************************************************************************/
+#ifdef __HW_OC__
+void oc_coil_open(void);
+void oc_inj_open(int inj);
+void oc_inj_close(int inj);
+#define IO_OPEN_COIL_HOOK(coil) oc_coil_open()
+#define IO_OPEN_INJECTOR_HOOK(inj) oc_inj_open(inj)
+#define IO_CLOSE_INJECTOR_HOOK(inj) oc_inj_close(inj)
+#else
+#define IO_OPEN_COIL_HOOK(coil) do { } while(0)
+#define IO_OPEN_INJECTOR_HOOK(inj) do { } while(0)
+#define IO_CLOSE_INJECTOR_HOOK(inj) do { } while(0)
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/******************************************************************************/
+/* Console */
+/******************************************************************************/
+/*
+ * Interrupt driven UART on top of the baud rate / frame format set by lib_init().
+ * stdin / stdout are re-routed here so FORCE_PRINT, the tooth log and the
+ * deferred log all go through the TX ring:
+ *	- TX: Never waits. A byte that doesn't fit is dropped and counted. The
+ *	  data register empty IRQ feeds the UART as long as the ring isn't empty.
+ *	- RX: The receive IRQ fills the ring; A byte that doesn't fit is counted.
+ * With IRQ disabled ( before OSStart(), osdie() ) both sides fall back to
+ * polling the UART so nothing is lost and the unit test still works.
+ */
+#define TX_SIZE 128 /* Power of 2 with free running byte index; Holds TX_SIZE - 1 */
+#define TX_MASK (TX_SIZE - 1)
+#define TX_ROOM(h, t) (TX_SIZE - 1 - (unsigned char)((h) - (t)))
+#define RX_SIZE 64 /* A whole tuning frame */
+#define RX_MASK (RX_SIZE - 1)
+
+static unsigned char tx[TX_SIZE], rx[RX_SIZE];
+static volatile unsigned char tx_head, tx_tail, rx_head, rx_tail;
+static volatile unsigned long tx_bytes;
+static volatile unsigned short tx_drop, rx_drop;
+static unsigned long dump_time, dump_bytes;
+
+ISR(USART_UDRE_vect)
+{
+	unsigned char t = tx_tail;
+
+	if(t == tx_head){
+		UCSR0B &= ~_BV(UDRIE0);
+		return;
+	}
+	UDR0 = tx[t & TX_MASK];
+	tx_tail = t + 1;
+	tx_bytes++;
+}
+
+/* Wakes up the management thread when the ring goes non empty */
+ISR_NAKED ISR(USART_RX_vect)
+{
+	unsigned char h, c;
+
+	portSAVE_CONTEXT();
+	OSIntEnter();
+
+	h = rx_head;
+	if(UCSR0A & _BV(DOR0))
+		rx_drop++; /* Hardware overrun */
+	c = UDR0;
+	if((unsigned char)(h - rx_tail) == RX_SIZE){
+		rx_drop++;
+		goto out;
+	}
+	rx[h & RX_MASK] = c;
+	rx_head = h + 1;
+	if(h == rx_tail)
+		mgmt_post(MGMT_RX);
+
+out:
+	OSIntExit();
+	portRESTORE_CONTEXT();
+	__asm__ __volatile__ ( "reti" );
+}
+
+/* IRQ disabled; Empty the ring first to keep the order */
+static void tx_poll(unsigned char c)
+{
+	while(tx_tail != tx_head){
+		while(!(UCSR0A & _BV(UDRE0)));
+		UDR0 = tx[tx_tail & TX_MASK];
+		tx_tail++;
+		tx_bytes++;
+	}
+	while(!(UCSR0A & _BV(UDRE0)));
+	UDR0 = c;
+	tx_bytes++;
+}
+
+static int console_put(char c, FILE *f)
+{
+	unsigned char sreg = SREG, h;
+
+	if(!(sreg & _BV(SREG_I))){
+		tx_poll(c);
+		return 0;
+	}
+	cli();
+	h = tx_head;
+	if(!TX_ROOM(h, tx_tail))
+		tx_drop++;
+	else{
+		tx[h & TX_MASK] = c;
+		tx_head = h + 1;
+		UCSR0B |= _BV(UDRIE0);
+	}
+	SREG = sreg;
+	return 0;
+}
+
+int console_getc(void)
+{
+	unsigned char t = rx_tail;
+	int c;
+
+	if(!(SREG & _BV(SREG_I))){
+		if(!(UCSR0A & _BV(RXC0)))
+			return -1;
+		return UDR0;
+	}
+	if(t == rx_head)
+		return -1;
+	c = rx[t & RX_MASK];
+	rx_tail = t + 1;
+	return c;
+}
+
+/* stdin is blocking for the unit test; Everything else uses console_getc() */
+static int console_get(FILE *f)
+{
+	int c;
+
+	while((c = console_getc()) < 0);
+	return c;
+}
+
+void console_putc(unsigned char c)
+{
+	console_put(c, stdout);
+}
+
+/* The data register empty IRQ drains the ring */
+void console_flush(void)
+{
+}
+
+/* Room in the TX ring so that a frame can go out in one piece; Polling never drops */
+int console_tx_room(void)
+{
+	if(!(SREG & _BV(SREG_I)))
+		return CONSOLE_TX_UNBOUNDED;
+	return TX_ROOM(tx_head, tx_tail);
+}
+
+/* Output bandwidth since the previous dump */
+void console_dump(void)
+{
+	unsigned char sreg = SREG;
+	unsigned long now, b, dt;
+
+	cli();
+	b = tx_bytes;
+	SREG = sreg;
+	now = get_monotonic_tick();
+	dt = (now - dump_time) / TICK_PER_MSEC;
+
+	FORCE_PRINT("UART TX %ld B/s DROP %u RX DROP %u\n",
+		dt ? ((b - dump_bytes) * 1000UL) / dt : 0UL, tx_drop, rx_drop);
+	dump_time = now;
+	dump_bytes = b;
+}
+
+static FILE console_stream = FDEV_SETUP_STREAM(console_put, console_get, _FDEV_SETUP_RW);
+
+/* After lib_init(); The UART is already configured */
+void console_init(void)
+{
+	stdout = &console_stream;
+	stdin = &console_stream;
+	stderr = &console_stream;
+	UCSR0B |= _BV(RXCIE0);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __IO_SOFT_H_
+#define __IO_SOFT_H_
+
+/*
+ * Platforms without hardware to drive ( x86 and ARM ); Shared by their
+ * arch header. The timer queue, the crank input and the console fall back
+ * on the lib in io_soft.c; The arch file only has the timebase and the init.
+ */
+#define __IO_SOFT__
+
+/******************************************************************************/
+/* Register accessors */
+/******************************************************************************/
+/* Nothing to drive on this platform; Two virtual ports keep the pin layout */
+enum { IO_PORT_A, IO_PORT_B, IO_PORT_NR };
+#define IO_FOR_EACH_PORT(X, arg) X(A, arg) X(B, arg)
+
+#define IO_CFG_OUTPUT(p, m) do { } while(0)
+#ifndef IO_PORT_SET /* The arch can look at the edges */
+#define IO_PORT_SET(p, m) do { (void)(m); } while(0)
+#define IO_PORT_CLR(p, m) do { (void)(m); } while(0)
+#endif
+
+/******************************************************************************/
+/* Pin descriptor */
+/******************************************************************************/
+#define INJ1_PORT IO_PORT_A
+#define INJ1_BIT (1 << 0)
+#define INJ2_PORT IO_PORT_A
+#define INJ2_BIT (1 << 1)
+#define INJ3_PORT IO_PORT_A
+#define INJ3_BIT (1 << 2)
+#define INJ4_PORT IO_PORT_A
+#define INJ4_BIT (1 << 3)
+
+#define COIL1_PORT IO_PORT_A
+#define COIL1_BIT (1 << 4)
+#define COIL2_PORT IO_PORT_A
+#define COIL2_BIT (1 << 5)
+#define COIL3_PORT IO_PORT_A
+#define COIL3_BIT (1 << 6)
+#define COIL4_PORT IO_PORT_A
+#define COIL4_BIT (1 << 7)
+
+#define RELAY_PORT IO_PORT_B
+#define RELAY_BIT (1 << 0)
+#define RELAY_ACTIVE_LOW 1
+
+#define GAZ_PORT IO_PORT_B
+#define GAZ_BIT (1 << 1)
+#define GAZ_ACTIVE_LOW 1
+
+#define STARTER_PORT IO_PORT_B
+#define STARTER_BIT (1 << 2)
+#define STARTER_ACTIVE_LOW 1
+
+/******************************************************************************/
+/* Platform */
+/******************************************************************************/
+/* Crank edge from whatever drives the input on this platform */
+void fake_irq(void);
+/* Software timer @deadline in tick; From the arch file */
+void io_schedule_tick(void (*fcn)(int arg, unsigned long t), int arg, unsigned long deadline);
+
+#ifdef __PLANT__
+void plant_init(void);
+void plant_dump(void);
+void plant_output(int port, unsigned char value, unsigned char changed);
+int plant_crank_level(void);
+#endif
+
+/******************************************************************************/
+/* Output compare hooks */
+/******************************************************************************/
+#define IO_OPEN_COIL_HOOK(coil) do { } while(0)
+#define IO_OPEN_INJECTOR_HOOK(inj) do { } while(0)
+#define IO_CLOSE_INJECTOR_HOOK(inj) do { } while(0)
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __IO_X86_H_
+#define __IO_X86_H_
+
+/******************************************************************************/
+/* Register accessors */
+/******************************************************************************/
+#if defined(__TRACE__) || defined(__PLANT__)
+/* Every edge of the virtual ports goes to the trace and the plant */
+void io_vport_write(int port, unsigned char m, int set);
+unsigned char io_vport_read(int port);
+#define IO_PORT_SET(p, m) io_vport_write(IO_PORT_##p, (m), 1)
+#define IO_PORT_CLR(p, m) io_vport_write(IO_PORT_##p, (m), 0)
+#endif
+
+#include <arch/io_soft.h>
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+#include <io.h>
+
+#ifdef __PLANT__
+#include <unistd.h>
+
+/*
+ * Engine plant for the x86 user port
+ *
+ * Generates the Subaru 36-2-2-2 crank wheel from a crank model that reacts
+ * to what the ECU drives on the virtual ports:
+ *	- Fuel is the injector open time summed per cylinder and burnt on the
+ *	  next spark of that cylinder near its compression TDC.
+ *	- The energy of a combustion depends on the mixture against the air
+ *	  let in by the throttle and on the spark advance against MBT.
+ *	- Friction grows with the speed; The starter drags the engine toward
+ *	  cranking speed.
+ *	- Compression makes the speed dip toward every TDC; The dip is large
+ *	  when cranking and fades as the speed goes up.
+ *
+ * The speed is carried as energy (RPM^2) and updated on every 10deg slot.
+ * No libm; The port Makefile doesn't link it.
+ * Plant frame is the ECU degree frame with TDC1 power stroke @0deg; The ECU
+ * doesn't know the phase so trim_to_sequential() has something to find.
+ *
+ * Knobs from the environment:
+ *	SIM_THROTTLE	% of the air, default 20
+ *	SIM_PROFILE	Throttle over time "sec:%,sec:%,..."; Overrides SIM_THROTTLE
+ *	SIM_NOISE	Tooth period jitter in 0.1%, default 0
+ *	SIM_SEED	Seed of the jitter
+ *	SIM_SCALE	Simulated time runs that much faster than the wall clock
+ *
+ * Batch mode, used by tools/sim_sweep.py:
+ *	SIM_ADVANCE	Timing advance enabled with that value
+ *	SIM_FUEL	fuel_msec
+ *	SIM_TRIM	trim_to_sequential() enabled
+ *	SIM_AUTOSTART	Relay and starter on at power up like the operator would
+ *	SIM_DURATION	Sec; Print one "SIM key=value ..." line and exit
+ */
+#define SLOT_DEG TRIGGER_WHEEL_RESOLUTION
+#define SLOT_NR (DEGREE_PER_ENGINE_CYCLE / SLOT_DEG)
+#define STOP_POLL_TICK (10 * TICK_PER_MSEC)
+
+#define STOICH_USEC_WOT 24000.0 /* Injector time per cylinder per cycle @100% throttle */
+#define FIRE_ENERGY 800000.0 /* RPM^2 per combustion @100% throttle */
+#define FRICTION_0 50.0 /* RPM^2 per deg */
+#define FRICTION_1 0.5 /* RPM^2 per deg per RPM */
+#define STARTER_ENERGY 1050.0 /* RPM^2 per deg at stand still */
+#define STARTER_RPM 300.0 /* Starter runs out of torque */
+#define MAX_RPM 7500.0
+#define MISFIRE_RATIO 0.5 /* Leaner than that doesn't light */
+#define PROFILE_MAX 16
+
+struct cyl{
+	int coil_bit;
+	int inj_bit;
+	int tdc; /* Power stroke */
+	double fuel_usec;
+	unsigned long inj_open;
+};
+
+/* Firing order 1-3-2-4 */
+static struct cyl cyl[4] = {
+	{ COIL1_BIT, INJ1_BIT, 0 },
+	{ COIL2_BIT, INJ2_BIT, 360 },
+	{ COIL3_BIT, INJ3_BIT, 180 },
+	{ COIL4_BIT, INJ4_BIT, 540 },
+};
+
+/* cos() of the slot position within a 180deg compression period */
+static const double compression_cos[180 / SLOT_DEG] = {
+	1.0, 0.9397, 0.7660, 0.5, 0.1736, -0.1736, -0.5, -0.7660, -0.9397,
+	-1.0, -0.9397, -0.7660, -0.5, -0.1736, 0.1736, 0.5, 0.7660, 0.9397,
+};
+
+static double throttle, noise;
+static double rpm; /* Mean speed */
+static long energy; /* Pending from the combustion; Written from the ECU context */
+static unsigned long slot_t; /* Tick of the current slot */
+static double slot_rpm; /* Instantaneous speed over the current slot */
+static int slot; /* Current slot */
+static volatile int crank_level;
+static unsigned long fire, misfire;
+static long adv_sum;
+
+/* Throttle profile */
+static struct{
+	unsigned long t;
+	double throttle;
+} profile[PROFILE_MAX];
+static int profile_nr;
+
+/* Metrics; The RPM is sampled on every slot once in RUN */
+static unsigned long start_t, duration, stall;
+static double rpm_sum, rpm_sq, rpm_min, rpm_max;
+static unsigned long rpm_nr;
+
+/* Missing teeth 12,13 15,16 30,31 on both turns */
+static int tooth_present(int s)
+{
+	s = s % 36;
+	return !(s == 12 || s == 13 || s == 15 || s == 16 || s == 30 || s == 31);
+}
+
+static int pin_active(int port, int bit, int active_low)
+{
+	int v = io_vport_read(port) & bit;
+	return active_low ? !v : !!v;
+}
+
+/* Current crank angle; Interpolated inside the slot */
+static double plant_angle(unsigned long t)
+{
+	double d;
+
+	d = (double)(long)(t - slot_t) * slot_rpm * 6.0 / TICK_PER_SEC;
+	if(d > SLOT_DEG)
+		d = SLOT_DEG;
+	return slot * SLOT_DEG + d;
+}
+
+/* Advance of a spark at angle a for a cylinder; Out of range ==> exhaust stroke */
+static int spark_advance_deg(struct cyl *c, double a, double *adv)
+{
+	double d = c->tdc - a;
+
+	while(d > 360)
+		d -= DEGREE_PER_ENGINE_CYCLE;
+	while(d < -360)
+		d += DEGREE_PER_ENGINE_CYCLE;
+	if(d > 90 || d < -30)
+		return -1;
+	*adv = d;
+	return 0;
+}
+
+static void combustion(struct cyl *c, unsigned long t)
+{
+	double adv, mbt, stoich, r, mix, eff;
+
+	if(spark_advance_deg(c, plant_angle(t), &adv) < 0)
+		return;
+
+	stoich = STOICH_USEC_WOT * throttle;
+	r = c->fuel_usec / stoich;
+	c->fuel_usec = 0;
+	if(r < MISFIRE_RATIO || !pin_active(RELAY_PORT, RELAY_BIT, RELAY_ACTIVE_LOW)){
+		misfire++;
+		return;
+	}
+	/* Rich still burns, just not as well */
+	mix = (r <= 1.0) ? r : 1.0 - (r - 1.0) * 0.15;
+	if(mix < 0.2)
+		mix = 0.2;
+
+	/* MBT moves up with the speed; Too early / too late loses the power */
+	mbt = 15.0 + rpm / 200.0;
+	if(mbt > 35.0)
+		mbt = 35.0;
+	eff = 1.0 - ((adv - mbt) / 40.0) * ((adv - mbt) / 40.0);
+	if(eff < -0.2)
+		eff = -0.2;
+
+	__atomic_fetch_add(&energy, (long)(FIRE_ENERGY * throttle * mix * eff), __ATOMIC_RELAXED);
+	fire++;
+	adv_sum += adv;
+}
+
+/* Called on every edge of the virtual ports */
+void plant_output(int port, unsigned char value, unsigned char changed)
+{
+	unsigned long t = get_monotonic_tick();
+	int x;
+
+	for(x=0; x<4; x++){
+		if(port == INJ1_PORT && (changed & cyl[x].inj_bit)){
+			if(value & cyl[x].inj_bit)
+				cyl[x].inj_open = t;
+			else
+				cyl[x].fuel_usec += TICK_TO_USEC(t - cyl[x].inj_open);
+		}
+		/* Spark on the falling edge of the coil */
+		if(port == COIL1_PORT && (changed & cyl[x].coil_bit) && !(value & cyl[x].coil_bit))
+			combustion(&cyl[x], t);
+	}
+}
+
+int plant_crank_level(void)
+{
+	return crank_level;
+}
+
+/* sqrt(); The speed barely moves per slot so the last one is a good guess */
+static double speed(double e, double guess)
+{
+	int x;
+
+	if(guess < 1.0)
+		guess = 1.0;
+	for(x=0; x<32; x++)
+		guess = (guess + e / guess) / 2.0;
+	return guess;
+}
+
+static void plant_report(unsigned long t)
+{
+	double mean = rpm_nr ? rpm_sum / rpm_nr : 0;
+	double var = rpm_nr ? rpm_sq / rpm_nr - mean * mean : 0;
+
+	FORCE_PRINT("SIM time_to_start=%ld state=%d rpm_mean=%.1f rpm_sd=%.1f rpm_min=%.0f "
+		"rpm_max=%.0f fire=%lu misfire=%lu stall=%lu adv=%ld\n",
+		engine_state == ENGINE_RUN || time_to_start ? (long)time_to_start : -1L,
+		engine_state, mean, var > 0 ? speed(var, 1.0) : 0, rpm_min, rpm_max,
+		fire, misfire, stall, fire ? adv_sum / (long)fire : 0);
+	fflush(stdout);
+	_exit(0);
+}
+
+/* Profile is in sec since power up; Step from one point to the next */
+static void plant_profile(unsigned long t)
+{
+	int x;
+
+	for(x=0; x<profile_nr; x++){
+		if((long)(t - start_t - profile[x].t) >= 0)
+			throttle = profile[x].throttle;
+	}
+}
+
+static void plant_metrics(unsigned long t)
+{
+	if(engine_state != ENGINE_RUN)
+		return;
+	if(!rpm_nr || rpm < rpm_min)
+		rpm_min = rpm;
+	if(rpm > rpm_max)
+		rpm_max = rpm;
+	rpm_sum += rpm;
+	rpm_sq += rpm * rpm;
+	rpm_nr++;
+}
+
+static void plant_tick(int arg, unsigned long now)
+{
+	double e, a, p;
+	unsigned long t;
+
+	t = get_monotonic_tick();
+	if(duration && (long)(t - start_t - duration) >= 0)
+		plant_report(t);
+	plant_profile(t);
+	plant_metrics(t);
+
+	/* Energy over the slot we just went thru */
+	e = rpm * rpm + __atomic_exchange_n(&energy, 0, __ATOMIC_RELAXED);
+	e -= (FRICTION_0 + FRICTION_1 * rpm) * SLOT_DEG;
+	if(pin_active(STARTER_PORT, STARTER_BIT, STARTER_ACTIVE_LOW) && rpm < STARTER_RPM)
+		e += STARTER_ENERGY * (1.0 - rpm / STARTER_RPM) * SLOT_DEG;
+	if(e <= 0){
+		if(rpm > 0 && time_to_start)
+			stall++;
+		rpm = 0;
+		slot_rpm = 0;
+		io_schedule_tick(plant_tick, 0, t + STOP_POLL_TICK);
+		return;
+	}
+	rpm = speed(e, rpm);
+	if(rpm > MAX_RPM)
+		rpm = MAX_RPM;
+
+	slot = (slot + 1) % SLOT_NR;
+	slot_t = t;
+	if(tooth_present(slot)){
+		crank_level = 1;
+		fake_irq();
+		crank_level = 0;
+	}
+
+	/* Compression: slowest right at every TDC */
+	a = 40.0 / rpm;
+	if(a > 0.25)
+		a = 0.25;
+	slot_rpm = rpm * (1.0 - a * compression_cos[(slot * SLOT_DEG % 180) / SLOT_DEG]);
+	p = SLOT_DEG * TICK_PER_SEC / (6.0 * slot_rpm);
+	if(noise > 0)
+		p += p * noise * ((double)rand() / RAND_MAX - 0.5) * 2.0;
+	io_schedule_tick(plant_tick, 0, t + (unsigned long)p);
+}
+
+void plant_dump(void)
+{
+	FORCE_PRINT("PLANT RPM %d FIRE %lu MISFIRE %lu ADV %ld\n", (int)rpm, fire, misfire,
+		fire ? adv_sum / (long)fire : 0);
+}
+
+static double env(const char *name, double def)
+{
+	const char *s = getenv(name);
+	return s ? atof(s) : def;
+}
+
+static void profile_init(const char *s)
+{
+	char *end;
+
+	for(profile_nr=0; s && *s && profile_nr<PROFILE_MAX; profile_nr++){
+		profile[profile_nr].t = strtod(s, &end) * TICK_PER_SEC;
+		if(*end != ':')
+			DIE(FATAL);
+		profile[profile_nr].throttle = strtod(end + 1, &end) / 100.0;
+		s = (*end == ',') ? end + 1 : end;
+	}
+}
+
+void plant_init(void)
+{
+	throttle = env("SIM_THROTTLE", 20) / 100.0;
+	noise = env("SIM_NOISE", 0) / 1000.0;
+	srand(env("SIM_SEED", 1));
+	profile_init(getenv("SIM_PROFILE"));
+	if(getenv("SIM_ADVANCE")){
+		timing_advance = env("SIM_ADVANCE", 0);
+		timing_advance_enabled = 1;
+	}
+	fuel_msec = env("SIM_FUEL", fuel_msec);
+	trim_flag = env("SIM_TRIM", 0);
+	duration = env("SIM_DURATION", 0) * TICK_PER_SEC;
+	rpm = 0;
+	slot = 0;
+	start_t = get_monotonic_tick();
+	if(env("SIM_AUTOSTART", 0)){
+		io_relay_on();
+		starter_on();
+	}
+	io_schedule_tick(plant_tick, 0, start_t + STOP_POLL_TICK);
+}
+#endif
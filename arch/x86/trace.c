@@ -0,0 +1,299 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+#include <io.h>
+
+#ifdef __TRACE__
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Virtual output trace for the x86 user port
+ *
+ * The scheduling path only reserves a slot with a CAS and fills it; No lock,
+ * no syscall and no allocation. A background thread drains the ring into a
+ * binary file so the run can be checked and benchmarked after the fact.
+ * When the ring is full the record is dropped and counted, the ECU never waits
+ * on the file.
+ *
+ * File: header then fixed size records, little endian
+ *	u32 magic, u16 version, u16 tick per usec
+ *	u32 tick, u8 type, u8 id, u8 value, u8 arg
+ * The tick is the low 32 bit of get_monotonic_tick() and wraps.
+ *
+ * With ECU_VCD set the same thread also streams a VCD waveform of the run.
+ */
+#define TRACE_SIZE 65536 /* Power of 2 */
+#define TRACE_MAGIC 0x54554345 /* "ECUT" */
+#define TRACE_VERSION 1
+#define TRACE_FILE "ecu_trace.bin" /* Override with ECU_TRACE */
+#define TRACE_BATCH 1024
+#define TRACE_FLUSH_USEC 10000
+
+struct trace_rec{
+	unsigned int t;
+	unsigned char type;
+	unsigned char id;
+	unsigned char value;
+	unsigned char arg;
+};
+
+struct trace_slot{
+	unsigned int seq; /* Index + 1 once the record is complete */
+	struct trace_rec rec;
+};
+
+static struct trace_slot ring[TRACE_SIZE];
+static unsigned int head, tail, drop;
+static FILE *trace_file;
+
+void trace_record(unsigned char type, unsigned char id, unsigned char value, unsigned char arg)
+{
+	unsigned int h;
+	struct trace_slot *s;
+
+	h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	do{
+		if(h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= TRACE_SIZE){
+			__atomic_fetch_add(&drop, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}while(!__atomic_compare_exchange_n(&head, &h, h + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	s = &ring[h & (TRACE_SIZE - 1)];
+	s->rec.t = get_monotonic_tick();
+	s->rec.type = type;
+	s->rec.id = id;
+	s->rec.value = value;
+	s->rec.arg = arg;
+	__atomic_store_n(&s->seq, h + 1, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************/
+/* VCD */
+/******************************************************************************/
+/*
+ * Only the current value of each signal is kept so memory is bounded no
+ * matter how long the run is. Records are in slot order which is not
+ * strictly time order across producers; Time never goes back in the file.
+ */
+struct vcd_pin{
+	const char *name;
+	unsigned char port;
+	unsigned char bit;
+};
+
+static const struct vcd_pin vcd_pin[] = {
+	{ "inj1", INJ1_PORT, INJ1_BIT },
+	{ "inj2", INJ2_PORT, INJ2_BIT },
+	{ "inj3", INJ3_PORT, INJ3_BIT },
+	{ "inj4", INJ4_PORT, INJ4_BIT },
+	{ "coil1", COIL1_PORT, COIL1_BIT },
+	{ "coil2", COIL2_PORT, COIL2_BIT },
+	{ "coil3", COIL3_PORT, COIL3_BIT },
+	{ "coil4", COIL4_PORT, COIL4_BIT },
+	{ "relay_n", RELAY_PORT, RELAY_BIT },
+	{ "gaz_n", GAZ_PORT, GAZ_BIT },
+	{ "starter_n", STARTER_PORT, STARTER_BIT },
+};
+#define VCD_PIN_NR (sizeof(vcd_pin) / sizeof(vcd_pin[0]))
+
+/* Identifier of the pins are 'a' + index */
+#define VCD_CRANK '!'
+#define VCD_SYNC '"'
+#define VCD_STATE '#'
+#define VCD_EVENT '$'
+#define VCD_EVENT_DEG '%'
+#define VCD_EVENT_COOKIE '&'
+#define VCD_PUMP '\''
+#define VCD_DROP '('
+
+static FILE *vcd_file;
+static unsigned long long vcd_t;
+static unsigned int vcd_last, vcd_drop;
+
+static void vcd_vector(int id, unsigned int v, int width)
+{
+	char b[33];
+	int x;
+
+	for(x=0; x<width; x++)
+		b[x] = (v & (1U << (width - 1 - x))) ? '1' : '0';
+	b[width] = 0;
+	fprintf(vcd_file, "b%s %c\n", b, id);
+}
+
+static void vcd_header(void)
+{
+	unsigned int x;
+
+	fprintf(vcd_file, "$timescale 1 ns $end\n");
+	fprintf(vcd_file, "$scope module ecu $end\n");
+	fprintf(vcd_file, "$var event 1 %c crank $end\n", VCD_CRANK);
+	fprintf(vcd_file, "$var wire 1 %c sync $end\n", VCD_SYNC);
+	fprintf(vcd_file, "$var integer 8 %c engine_state $end\n", VCD_STATE);
+	fprintf(vcd_file, "$var event 1 %c event $end\n", VCD_EVENT);
+	fprintf(vcd_file, "$var integer 16 %c event_deg $end\n", VCD_EVENT_DEG);
+	fprintf(vcd_file, "$var integer 8 %c event_cookie $end\n", VCD_EVENT_COOKIE);
+	fprintf(vcd_file, "$var integer 8 %c pump $end\n", VCD_PUMP);
+	fprintf(vcd_file, "$var integer 32 %c drop $end\n", VCD_DROP);
+	for(x=0; x<VCD_PIN_NR; x++)
+		fprintf(vcd_file, "$var wire 1 %c %s $end\n", 'a' + x, vcd_pin[x].name);
+	fprintf(vcd_file, "$upscope $end\n$enddefinitions $end\n");
+
+	/* Everything starts low / ENGINE_STOP */
+	fprintf(vcd_file, "#0\n$dumpvars\n0%c\n", VCD_SYNC);
+	vcd_vector(VCD_STATE, ENGINE_STOP, 8);
+	vcd_vector(VCD_EVENT_DEG, 0, 16);
+	vcd_vector(VCD_EVENT_COOKIE, 0, 8);
+	vcd_vector(VCD_PUMP, 0, 8);
+	vcd_vector(VCD_DROP, 0, 32);
+	for(x=0; x<VCD_PIN_NR; x++)
+		fprintf(vcd_file, "0%c\n", 'a' + x);
+	fprintf(vcd_file, "$end\n");
+}
+
+/* 32 bit tick ==> 64 bit nsec; The first record is time 0 */
+static void vcd_time(unsigned int t)
+{
+	static int started;
+	int d;
+
+	if(!started){
+		started = 1;
+		vcd_last = t;
+		return;
+	}
+	d = t - vcd_last;
+	if(d <= 0)
+		return;
+	vcd_last = t;
+	vcd_t += (unsigned long long)d * 1000 / TICK_PER_USEC;
+	fprintf(vcd_file, "#%llu\n", vcd_t);
+}
+
+static void vcd_write(struct trace_rec *r)
+{
+	unsigned int x;
+
+	vcd_time(r->t);
+	switch(r->type){
+	case TRACE_IO:
+		for(x=0; x<VCD_PIN_NR; x++){
+			if(vcd_pin[x].port != r->id || !(vcd_pin[x].bit & r->arg))
+				continue;
+			fprintf(vcd_file, "%c%c\n", (vcd_pin[x].bit & r->value) ? '1' : '0', 'a' + x);
+		}
+		break;
+	case TRACE_PUMP:
+		vcd_vector(VCD_PUMP, r->value, 8);
+		break;
+	case TRACE_DROP:
+		vcd_drop += (r->value << 8) | r->arg;
+		vcd_vector(VCD_DROP, vcd_drop, 32);
+		break;
+	case TRACE_CRANK:
+		fprintf(vcd_file, "1%c\n", VCD_CRANK);
+		break;
+	case TRACE_STATE:
+		vcd_vector(VCD_STATE, r->value, 8);
+		fprintf(vcd_file, "%c%c\n",
+			(r->value == ENGINE_CRANK || r->value == ENGINE_RUN) ? '1' : '0', VCD_SYNC);
+		break;
+	case TRACE_EVENT:
+		vcd_vector(VCD_EVENT_DEG, (r->value << 8) | r->arg, 16);
+		vcd_vector(VCD_EVENT_COOKIE, r->id, 8);
+		fprintf(vcd_file, "1%c\n", VCD_EVENT);
+		break;
+	}
+}
+
+/******************************************************************************/
+/* Drain */
+/******************************************************************************/
+static void *trace_thread(void *p)
+{
+	static struct trace_rec buf[TRACE_BATCH];
+	struct trace_slot *s;
+	unsigned int n, d, x, old_drop = 0;
+
+	while(1){
+		n = 0;
+		while(n < TRACE_BATCH){
+			s = &ring[tail & (TRACE_SIZE - 1)];
+			if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + 1)
+				break;
+			buf[n++] = s->rec;
+			__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+		}
+
+		/* 16 bit per record; The rest goes out on the next pass */
+		d = __atomic_load_n(&drop, __ATOMIC_RELAXED) - old_drop;
+		if(d && n < TRACE_BATCH){
+			if(d > 0xffff)
+				d = 0xffff;
+			buf[n].t = get_monotonic_tick();
+			buf[n].type = TRACE_DROP;
+			buf[n].id = 0;
+			buf[n].value = d >> 8;
+			buf[n].arg = d;
+			n++;
+			old_drop += d;
+		}
+
+		if(n){
+			fwrite(buf, sizeof(buf[0]), n, trace_file);
+			fflush(trace_file);
+			if(vcd_file){
+				for(x=0; x<n; x++)
+					vcd_write(&buf[x]);
+				fflush(vcd_file);
+			}
+		}
+		if(n < TRACE_BATCH)
+			usleep(TRACE_FLUSH_USEC);
+	}
+	return NULL;
+}
+
+void trace_init(void)
+{
+	pthread_t th;
+	const char *f;
+	unsigned int magic = TRACE_MAGIC;
+	unsigned short hdr[2] = { TRACE_VERSION, TICK_PER_USEC };
+
+	f = getenv("ECU_TRACE");
+	if(!f)
+		f = TRACE_FILE;
+	trace_file = fopen(f, "wb");
+	if(!trace_file)
+		DIE(FATAL);
+	fwrite(&magic, sizeof(magic), 1, trace_file);
+	fwrite(hdr, sizeof(hdr), 1, trace_file);
+
+	f = getenv("ECU_VCD");
+	if(f){
+		vcd_file = fopen(f, "w");
+		if(!vcd_file)
+			DIE(FATAL);
+		vcd_header();
+	}
+
+	if(pthread_create(&th, NULL, trace_thread, NULL))
+		DIE(FATAL);
+	pthread_detach(th);
+}
+#endif
@@ -49,22 +49,32 @@
 #define SYNC_3_DEGREE_POSITION 140
 
 /* 
- * The smallest period is when the RPM is high @6000RPM
- * 	1/(@6000 RPM / 60) / 36 == 277uSec
+ * The smallest period is when the RPM is high @8000RPM; Well above the
+ * ~6000RPM redline since the tooth period moves by a few % within a cycle
+ * and a real tooth at the redline must not be taken for a glitch ( DIE )
+ * 	1/(@8000 RPM / 60) / 36 == 208uSec
  *
- * The largest period is during cranking but we are limited to USHRT_MAX
- * and so if we account for the missing tooth ( x3 ) we have a minimum
- * RPM of around 80 RPM which should be enough.
+ * The largest period is during cranking; capture_t is 32 bit tick so
+ * the type doesn't limit it. Slower than 80 RPM, accounting for the
+ * missing tooth ( x3 ), is taken as the engine stopping.
  * 	1/(@80 RPM / 60) / 36 => X3 62500uSec
  *
  * The average period to declare the engine running is @500RPM
  * 	1/(@500 RPM / 60) / 36 => 3333uSec
  *
- * NOTE that everything is contained in an unsigned short
+ * NOTE that everything is in timer tick
  */
-#define MIN_TICK_PERIOD_USEC_6000RPM (277)
-#define MAX_TICK_PERIOD_USEC_80RPM (62500UL)
-#define AVERAGE_RUN_PERIOD (3333UL)
+#define MIN_TICK_PERIOD_8000RPM USEC_TO_TICK(208UL)
+#define MAX_TICK_PERIOD_80RPM USEC_TO_TICK(62500UL)
+#define AVERAGE_RUN_PERIOD USEC_TO_TICK(3333UL)
+#define CRANK_PERIOD USEC_TO_TICK(20000UL)
+
+/*
+ * MAP and O2 are sampled 90deg ATDC on every TDC i.e. in the middle of the intake stroke
+ *	TDC(1,2) is tooth 36 and TDC(3,4) is tooth 18
+ */
+#define MAP_TOOTH_1 9
+#define MAP_TOOTH_2 27
 
 #define MIN_SAMPLE 10 /* Debouncing Number of pulse */
 
@@ -73,8 +83,10 @@
 
 
 static int idx;
-static unsigned short vector[AVG_SIZE];
+static unsigned long vector[AVG_SIZE];
 static unsigned long running_sum;
+static unsigned char state, ctr, tooth_ctr;
+unsigned short sync_nr, no_sync_nr;
 
 static void init_vector(void)
 {
@@ -83,9 +95,9 @@ static void init_vector(void)
 	idx = 0;
 }
 
-static void add_vector(unsigned short t)
+static void add_vector(unsigned long t)
 {
-	unsigned short old;
+	unsigned long old;
 	
 	/* Moving avegage; Initially old is = 0 so the sum is building up */
 	old = vector[idx];
@@ -112,23 +124,21 @@ static unsigned long trigger_wheel_get_average(void)
 }
 
 /*
- * t is the pulse period in usec measured on the rising edge
+ * t is the pulse period in tick measured on the rising edge
  */
-unsigned char run_trigger_wheel(unsigned short t)
+unsigned char run_trigger_wheel(unsigned long t)
 {
-	static unsigned char state = 0, ctr, tooth_ctr;
 	int err = ENGINE_INIT;
 	unsigned long a;
 
-	if(record_mode)
-		FORCE_PRINT("%d:%ld\n", t, trigger_wheel_get_average());
-
 	/* Account for the missing tooth */
-	if (t > MAX_TICK_PERIOD_USEC_80RPM || t < MIN_TICK_PERIOD_USEC_6000RPM){
-		/* Losing the SYNC at run-time is no good */
-		if(state == 4){ /* Losing SYNC at run-time is no good */
-			FORCE_PRINT("Glitch %d:%d\n", t, state);
-			DIE(TRIGGER);
+	if (t > MAX_TICK_PERIOD_80RPM || t < MIN_TICK_PERIOD_8000RPM){
+		if(state == 4){
+			LOG2(LOG_GLITCH, t, state);
+			if(t < MIN_TICK_PERIOD_8000RPM) /* Losing SYNC at run-time is no good */
+				DIE(TRIGGER);
+			state = 0; /* Slower than 80RPM; The engine is stopping */
+			return ENGINE_DEAD;
 		}
 		state = 0;
 	}
@@ -145,7 +155,7 @@ unsigned char run_trigger_wheel(unsigned short t)
 
 	case 1:
 		/* Gather some stable pulse during crank */
-		if(t < 20000){ // TODO need proper check
+		if(t < CRANK_PERIOD){ // TODO need proper check
 			add_vector(t);
 			if(ctr >= MIN_SAMPLE){
 				ctr = 0;
@@ -160,13 +170,14 @@ unsigned char run_trigger_wheel(unsigned short t)
 	case 2: /* Scan for first missing tooth */
 		err = ENGINE_CRANK;
 		if(ctr > 20){ /* don't get stuck here TODO */
-			FORCE_PRINT("No Sync\n");
+			LOG0(LOG_NO_SYNC);
+			no_sync_nr++;
 			state = 0;
 			break;
 		}
 		a = trigger_wheel_get_average();
 		if(t > (a<<1)){ /* Twice the amplitude of average is a missing tooth */
-			PRINT("First Missing tooth SKIP %d:%d:%ld\n", ctr, t, a);
+			PRINT("First Missing tooth SKIP %d:%ld:%ld\n", ctr, t, a);
 			ctr = 0;
 			state = 3;
 			break;
@@ -178,18 +189,19 @@ unsigned char run_trigger_wheel(unsigned short t)
 		err = ENGINE_CRANK;
 		a = trigger_wheel_get_average();
 		if( (t > (a<<1)) && (ctr <2) ){ /* Twice the amplitude of average & right after the First missing tooth */
-			PRINT("Second Missing tooth %d\n", t);
+			PRINT("Second Missing tooth %ld\n", t);
 			tooth_ctr = SYNC_2_TOOTH_CTR_POSITION;
 			event_set_position(SYNC_2_DEGREE_POSITION / TRIGGER_WHEEL_RESOLUTION);
 		}
 		else{
 			/* Adjust the first missing tooth position */
-			PRINT("First Missing tooth ADJUST %d\n", t);
+			PRINT("First Missing tooth ADJUST %ld\n", t);
 			tooth_ctr = SYNC_1_TOOTH_CTR_POSITION+1;
 			event_set_position( (SYNC_1_DEGREE_POSITION+10) / TRIGGER_WHEEL_RESOLUTION);
 		}
 		add_vector(t); /* Don't add missing tooth to average */
 		event_tick(0);
+		sync_nr++;
 		state = 4;
 		break;
 
@@ -208,13 +220,18 @@ unsigned char run_trigger_wheel(unsigned short t)
 		if(tooth_ctr == SYNC_1_TOOTH_CTR_POSITION || tooth_ctr == SYNC_2_TOOTH_CTR_POSITION || tooth_ctr == SYNC_3_TOOTH_CTR_POSITION){
 			a = trigger_wheel_get_average();
 			if( !(t > (a<<1)) ){
-				FORCE_PRINT("SYNC %d:%ld\n", t, a);
+				LOG2(LOG_SYNC, t, a);
 				DIE(TRIGGER);
 			}
 		}
 		else
 			add_vector(t);
 
+		if(tooth_ctr == MAP_TOOTH_1 || tooth_ctr == MAP_TOOTH_2){
+			adc_request(ADC_MAP);
+			adc_request(ADC_EGO);
+		}
+
 		event_tick(0);
 
 		/* Check if _NEXT_ tooth is missing and if yes fake it */
@@ -231,6 +248,8 @@ unsigned char run_trigger_wheel(unsigned short t)
 	default:
 		DIE(TRIGGER);
 	}
+	if(record_mode)
+		toothlog_add(t, trigger_wheel_get_average(), tooth_ctr, state);
 	ctr++;
 	return err;
 }
@@ -239,22 +258,53 @@ int get_rpm(void)
 {
 	unsigned long one_turn, t;
 	one_turn = trigger_wheel_get_average() * (360UL / TRIGGER_WHEEL_RESOLUTION);
-	t = (USEC_PER_SEC * 60 ) / one_turn;
+	t = (TICK_PER_SEC * 60 ) / one_turn;
 	return t;
 }
 
 /*
  * At the current rate, how long does it take to go over n degree
  */
-unsigned long deg_to_usec(int degree)
+unsigned long deg_to_tick(int degree)
 {
 	if(degree <= 0)
 		return 0;
 	return ( (trigger_wheel_get_average() * (unsigned long)degree) /10UL);
 }
 
+/*
+ * Expected period of the _NEXT_ tooth; 0 when we are not in SYNC
+ */
+unsigned long trigger_wheel_next_period(void)
+{
+	unsigned long a;
+
+	if(state != 4)
+		return 0;
+	a = trigger_wheel_get_average();
+	/* Missing tooth were faked already so the next one is the long SYNC period */
+	if( (tooth_ctr == SYNC_1_TOOTH_CTR_POSITION-1) || (tooth_ctr == SYNC_2_TOOTH_CTR_POSITION-1) ||
+		(tooth_ctr == SYNC_3_TOOTH_CTR_POSITION-1) )
+		return a * 3;
+	return a;
+}
+
+/*
+ * Drop the SYNC and start over from scratch on the next pulse
+ */
+void trigger_wheel_reset(void)
+{
+	OS_CPU_SR cpu_sr;
+
+	OS_ENTER_CRITICAL();
+	state = 0;
+	capture_t = 0;
+	OS_EXIT_CRITICAL();
+}
+
 int trigger_wheel_init(void)
 {
+	state = 0;
 	init_vector();
 	trigger_wheel_init_platform();
 	return 0;
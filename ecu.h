@@ -15,11 +15,12 @@
 #ifndef __ECU_H_
 #define __ECU_H_
 
-//#define __DWELL_TEST__
-//#define __ADVANCE_TIMING_TEST__
-//#define __INJ_TEST__
-//#define __LOOP_TIMING_TEST__
 //#define __UNIT_TEST__ /* Basic IO test */
+//#define __HW_OC__ /* AVR: Spark and injector edges from Timer1 output compare */
+#if !defined(__AVR__) && !defined(__arm__) && !defined(__aarch64__) && !defined(__KERNEL__)
+#define __TRACE__ /* X86 user: Timestamped output edges to a binary file */
+#define __PLANT__ /* X86 user: Simulated engine drives the crank input */
+#endif
 
 #include <ucos_ii.h>
 
@@ -29,37 +30,59 @@
 extern OS_EVENT *engine_event;
 void engine_thread(void *p);
 
+/* Management thread events */
+enum mgmt_ev{
+	MGMT_STATE = 0, /* engine_state changed */
+	MGMT_RX, /* Console input */
+	MGMT_NR,
+};
+void mgmt_post(unsigned char ev);
+
+/******************************************************************************/
+/* Timebase */
+/******************************************************************************/
+/*
+ * Everything in the hot path is in native timer tick: capture, event, schedule.
+ * usec / msec are only used at the CLI boundary.
+ */
+#ifdef __AVR__
+#define TICK_PER_USEC 2UL /* Timer1 @F_CPU/8 */
+#else
+#define TICK_PER_USEC 1UL
+#endif
+#define TICK_PER_MSEC (TICK_PER_USEC * USEC_PER_MSEC)
+#define TICK_PER_SEC (TICK_PER_USEC * USEC_PER_SEC)
+#define USEC_TO_TICK(x) ((x) * TICK_PER_USEC)
+#define TICK_TO_USEC(x) ((x) / TICK_PER_USEC)
+
+unsigned long get_monotonic_tick(void);
+
 /******************************************************************************/
 /* Globals */
 /******************************************************************************/
 extern int trim_flag;
-extern int timing_advance, timing_advance_enabled;
+extern int timing_advance, timing_advance_enabled, reanchor_enabled;
 extern int fuel_msec;
 extern int record_mode;
-extern volatile unsigned short capture_t;
+extern volatile unsigned long capture_t;
 extern volatile unsigned long curr_time;
 extern int engine_state;
-#ifdef __DWELL_TEST__
-extern volatile unsigned long T1, DWELL_DEBUG;
-#endif
-#ifdef __INJ_TEST__
-extern volatile unsigned long T2, INJ_DEBUG;
-#endif
-#ifdef __ADVANCE_TIMING_TEST__
-extern volatile unsigned long T1, TIMING_DEBUG;
-#endif
+extern unsigned long time_to_start;
+extern unsigned short stall_nr;
+extern unsigned short sync_nr, no_sync_nr;
 
 /******************************************************************************/
 /* Engine 4 cyl / 4 stroke definition */
 /******************************************************************************/
+/* Logical output group; Dense so that the IO can index a table */
 #define CYL1 1
 #define CYL2 2
-#define CYL12 12
-#define CYL21 12
 #define CYL3 3
 #define CYL4 4
-#define CYL34 34
-#define CYL43 34
+#define CYL12 5
+#define CYL21 5
+#define CYL34 6
+#define CYL43 6
 #define DEGREE_PER_ENGINE_CYCLE 720UL
 
 struct engine_schedule{
@@ -70,6 +93,13 @@ struct engine_schedule{
 	unsigned char fuel_ctr;
 };
 
+/* Per cylinder trims CYL1 .. CYL4 */
+int engine_get_fuel_trim(int cyl);
+void engine_set_fuel_trim(int cyl, int v);
+int engine_get_spark_trim(int cyl);
+void engine_set_spark_trim(int cyl, int v);
+void spark_dump(void);
+
 enum engine_state{
 	ENGINE_STOP = 0,
 	ENGINE_INIT,
@@ -85,9 +115,11 @@ enum engine_state{
 
 int trigger_wheel_init(void);
 void trigger_wheel_init_platform(void);
-unsigned char run_trigger_wheel(unsigned short period);
+unsigned char run_trigger_wheel(unsigned long period);
+unsigned long trigger_wheel_next_period(void);
+void trigger_wheel_reset(void);
 int get_rpm(void);
-unsigned long deg_to_usec(int degree);
+unsigned long deg_to_tick(int degree);
 
 /******************************************************************************/
 /* Event */
@@ -113,25 +145,189 @@ void event_register(int degree, fcn_t fcn, unsigned char cookie);
 void event_callback(void);
 void event_tick(int flag);
 void event_set_position(int pos);
+int event_get_degree(void);
+void event_reset(void);
 void event_init(int size);
 
+/******************************************************************************/
+/* Timer queue */
+/******************************************************************************/
+typedef void(*work_t)(int arg, unsigned long t);
+
+void timerq_init(void);
+void timerq_add(work_t fcn, int arg, unsigned long deadline, int edge);
+void timerq_cancel(work_t fcn, int arg);
+void timerq_expire(void);
+void timerq_dump(void);
+void timerq_init_platform(void);
+void timerq_arm_platform(unsigned long deadline, int edge);
+
+/******************************************************************************/
+/* ADC */
+/******************************************************************************/
+enum adc_channel{
+	ADC_MAP = 0, /* Must be first; highest priority */
+	ADC_EGO, /* Wideband O2 */
+	ADC_TPS, /* Slow channels from here */
+	ADC_CLT,
+	ADC_IAT,
+	ADC_BAT,
+	ADC_CHANNEL_NR,
+};
+
+void adc_init(void);
+void adc_request(int ch);
+void adc_request_slow(void);
+void adc_complete(unsigned short raw);
+unsigned short adc_get(int ch);
+void adc_init_platform(void);
+int adc_start_platform(int ch);
+void adc_stop_platform(void);
+void nvram_read(void *dst, int offset, int len);
+int nvram_write_byte(int offset, unsigned char b);
+
+/******************************************************************************/
+/* Fuel */
+/******************************************************************************/
+extern int closed_loop;
+void fuel_init(void);
+unsigned long fuel_pulse_tick(int trim);
+void fuel_closed_loop(int cookie);
+void fuel_persist(void);
+void fuel_dump(void);
+void fuel_pump_update(int on);
+int fuel_table_read(int offset, signed char *buf, int len);
+int fuel_table_write(int offset, const signed char *buf, int len);
+#define FUEL_TABLE_SIZE 64 /* LTFT 8 RPM x 8 Load; Row major */
+
 /******************************************************************************/
 /* IO */
 /******************************************************************************/
 void io_init(void);
 void close_all_io(void);
+void close_engine_io(void);
 void io_open_injector(int inj);
 void io_close_injector(int inj, unsigned long t);
 void io_open_coil(int coil, unsigned long t);
 void io_close_coil(int coil, unsigned long t);
+void io_schedule_close_coil(int coil, unsigned long t);
+void io_schedule_close_injector(int inj, unsigned long t);
+#define PRIME_MSEC 17 /* Default prime pulse per injector */
+extern unsigned char prime_msec[CYL4];
+int prime_start(void);
+void prime_cancel(void);
+int prime_busy(void);
+void io_dump(void);
+void io_init_platform(void);
 void io_relay_off(void);
 void io_relay_on(void);
 void gaz_relay_off(void);
 void gaz_relay_on(void);
-void gaz_toggle(void);
+void pump_pwm_platform(unsigned char duty);
 void starter_off(void);
 void starter_on(void);
 
+/******************************************************************************/
+/* Console */
+/******************************************************************************/
+#define CONSOLE_TX_UNBOUNDED 0x7fff /* console_tx_room(): Polled or host buffered; Any frame fits */
+void console_init(void);
+int console_getc(void);
+void console_putc(unsigned char c);
+void console_flush(void);
+int console_tx_room(void);
+void console_dump(void);
+int proto_rx(unsigned char c);
+
+/******************************************************************************/
+/* Trace */
+/******************************************************************************/
+enum trace_type{
+	TRACE_IO = 0, /* id: port, value: port after the write, arg: bits that changed */
+	TRACE_PUMP, /* value: PWM duty */
+	TRACE_DROP, /* Ring was full; value:arg number of records lost */
+	TRACE_CRANK, /* Crank tooth captured */
+	TRACE_STATE, /* value: engine_state */
+	TRACE_EVENT, /* id: cookie, value:arg degree of the event dispatched */
+};
+
+#ifdef __TRACE__
+void trace_init(void);
+void trace_record(unsigned char type, unsigned char id, unsigned char value, unsigned char arg);
+#else
+#define trace_init() do { } while(0)
+#define trace_record(type, id, value, arg) do { } while(0)
+#endif
+
+/******************************************************************************/
+/* Tooth logger */
+/******************************************************************************/
+void toothlog_add(unsigned long t, unsigned long avg, unsigned char tooth, unsigned char state);
+void toothlog_event(unsigned char cookie, unsigned char slot);
+void toothlog_output(unsigned char id, int coil, int on);
+void toothlog_drain(void);
+
+/******************************************************************************/
+/* Deferred log */
+/******************************************************************************/
+/*
+ * X(id, number of argument, format); The arguments are long.
+ * On the 328 only the id and the raw arguments are queued and
+ * tools/logrender.py holds the format. Elsewhere the format is printed
+ * right away. NOTE the host parses this table; One entry per line.
+ */
+#define LOG_TABLE(X) \
+	X(LOG_DROP, 1, "LOG DROP %ld\n") \
+	X(LOG_GLITCH, 2, "Glitch %ld:%ld\n") \
+	X(LOG_SYNC, 2, "SYNC %ld:%ld\n") \
+	X(LOG_NO_SYNC, 0, "No Sync\n") \
+	X(LOG_TDC1_0, 0, "TDC1 @0deg \n") \
+	X(LOG_TDC1_360, 0, "TDC1 @360deg \n") \
+	X(LOG_STOP, 0, "STOP\n") \
+	X(LOG_INIT, 0, "INIT\n") \
+	X(LOG_CRANK, 0, "CRANK\n") \
+	X(LOG_RUN, 1, "RUN %ld msec\n") \
+	X(LOG_STARTER_OFF, 0, "STARTER OFF\n") \
+	X(LOG_DEAD, 0, "DEAD\n") \
+	X(LOG_DIE, 2, "DIE %ld : %ld\n")
+
+#define LOG_ID(id, n, fmt) id,
+enum log_id{
+	LOG_TABLE(LOG_ID)
+	LOG_NR,
+};
+
+#ifdef __AVR__
+#define __LOG_DEFERRED__
+#endif
+
+void log_msg(unsigned char id, long a, long b);
+#ifdef __LOG_DEFERRED__
+void log_drain(void);
+#else
+#define log_drain() do { } while(0)
+#endif
+#define LOG0(id) log_msg(id, 0, 0)
+#define LOG1(id, a) log_msg(id, (long)(a), 0)
+#define LOG2(id, a, b) log_msg(id, (long)(a), (long)(b))
+
+/******************************************************************************/
+/* Latency histograms */
+/******************************************************************************/
+#define HIST_BUCKET 16 /* log2; 2^14 tick and above in the last one */
+enum hist_id{
+	HIST_LATENCY = 0, /* Tooth to event callback; tick */
+	HIST_LOOP, /* Tooth to end of processing in the engine thread; tick */
+	HIST_ACTION, /* Engine state change to the management thread action; tick */
+	HIST_DWELL, /* Achieved dwell per coil output CYL1 .. CYL34; tick */
+	HIST_SPARK = HIST_DWELL + CYL34, /* Spark angle error per coil output; 1/10 deg */
+	HIST_INJ = HIST_SPARK + CYL34, /* Injector close error per injector; tick */
+	HIST_NR = HIST_INJ + CYL4,
+};
+
+void hist_add(int h, unsigned long v);
+void hist_dump(void);
+
 /******************************************************************************/
 /* Error handling */
 /******************************************************************************/
@@ -67,6 +67,41 @@ static struct engine_schedule four_stroke[4] = {
 	{ .degree = 540, .coil_cyl = CYL43, .fuel_cyl = CYL4 },
 };
 
+/*
+ * Per cylinder trims; Looked up thru the cylinder of the schedule entry so
+ * that they stay on their cylinder whatever the phase of the TDC slots.
+ * In wasted spark the coil pair gets the mean of both cylinders.
+ */
+static signed char fuel_trim[CYL4 + 1]; /* 1/256 of the fuel pulse */
+static signed char spark_trim[CYL34 + 1]; /* Degree on top of timing_advance */
+
+int engine_get_fuel_trim(int cyl)
+{
+	return fuel_trim[cyl];
+}
+
+void engine_set_fuel_trim(int cyl, int v)
+{
+	fuel_trim[cyl] = v;
+}
+
+int engine_get_spark_trim(int cyl)
+{
+	return spark_trim[cyl];
+}
+
+void engine_set_spark_trim(int cyl, int v)
+{
+	spark_trim[cyl] = v;
+	spark_trim[CYL12] = (spark_trim[CYL1] + spark_trim[CYL2]) / 2;
+	spark_trim[CYL34] = (spark_trim[CYL3] + spark_trim[CYL4]) / 2;
+}
+
+static inline int spark_advance(struct engine_schedule *sched)
+{
+	return timing_advance + spark_trim[sched->coil_cyl];
+}
+
 /******************************************************************************/
 /* ENGINE TRIM */
 /******************************************************************************/
@@ -74,7 +109,7 @@ static void tdc1_0deg(void)
 {
 	struct engine_schedule *sched;
 
-	FORCE_PRINT("TDC1 @0deg \n");
+	LOG0(LOG_TDC1_0);
 	sched = &four_stroke[0];
 	sched->coil_cyl = CYL1;
 	sched->fuel_cyl = CYL1;
@@ -93,7 +128,7 @@ static void tdc1_360deg(void)
 {
 	struct engine_schedule *sched;
 
-	FORCE_PRINT("TDC1 @360deg \n");
+	LOG0(LOG_TDC1_360);
 	sched = &four_stroke[0];
 	sched->coil_cyl = CYL2;
 	sched->fuel_cyl = CYL2;
@@ -108,29 +143,47 @@ static void tdc1_360deg(void)
 	sched->fuel_cyl = CYL3;
 }
 
+/* File scope so that a stall can start over from wasted spark */
+static int trim_state, trim_ctr, trim_avg_rpm, trim_min_rpm;
+
+static void trim_reset(void)
+{
+	four_stroke[0].coil_cyl = CYL12;
+	four_stroke[0].fuel_cyl = CYL1;
+	four_stroke[1].coil_cyl = CYL34;
+	four_stroke[1].fuel_cyl = CYL3;
+	four_stroke[2].coil_cyl = CYL21;
+	four_stroke[2].fuel_cyl = CYL2;
+	four_stroke[3].coil_cyl = CYL43;
+	four_stroke[3].fuel_cyl = CYL4;
+	trim_state = 0;
+	trim_ctr = 0;
+	trim_avg_rpm = 0;
+	trim_min_rpm = 0;
+}
+
 static void trim_to_sequential(void)
 {
 	int	r;
 	struct engine_schedule *sched;
-	static int state = 0, ctr = 0, avg_rpm = 0, min_rpm = 0;
 
-	if(state == -1)
+	if(trim_state == -1)
 		return;
 
 	r = get_rpm();
-//	PRINT("RPM %d:%d\n",r, state);
+//	PRINT("RPM %d:%d\n",r, trim_state);
 	
-	switch (state){
+	switch (trim_state){
 	case 0:
-		avg_rpm = avg_rpm + r;
-		ctr++;
-		if(ctr >= 16){
-			avg_rpm = avg_rpm >> 4;
-			min_rpm = divu10(avg_rpm);
-			min_rpm = avg_rpm - min_rpm;
-			PRINT("Target RPM >= %d\n", min_rpm);
-			ctr = 0;
-			state = 1;
+		trim_avg_rpm = trim_avg_rpm + r;
+		trim_ctr++;
+		if(trim_ctr >= 16){
+			trim_avg_rpm = trim_avg_rpm >> 4;
+			trim_min_rpm = divu10(trim_avg_rpm);
+			trim_min_rpm = trim_avg_rpm - trim_min_rpm;
+			PRINT("Target RPM >= %d\n", trim_min_rpm);
+			trim_ctr = 0;
+			trim_state = 1;
 		}
 		break;
 	case 1:
@@ -143,20 +196,20 @@ static void trim_to_sequential(void)
 		sched->coil_cyl = CYL1;
 		sched = &four_stroke[1];
 		sched->coil_cyl = CYL3;
-		state = 2;
+		trim_state = 2;
 		break;
 	case 2:
 		/*
 		 * If RPM is holding within 10% for few turns that means we are TDC1 @ 0deg
 		 * so we can trim down the remaining TDC3 and TDC4
 		 */
-		ctr++;
-		if(ctr > 10 && r >= min_rpm){
+		trim_ctr++;
+		if(trim_ctr > 10 && r >= trim_min_rpm){
 			tdc1_0deg();
-			state = -1;
+			trim_state = -1;
 			break;
 		}
-		if(r < min_rpm ){
+		if(r < trim_min_rpm ){
 			/* 
 			 * If RPM drops then put everything back in full Wasted Spark
 			 */
@@ -165,7 +218,7 @@ static void trim_to_sequential(void)
 			sched->coil_cyl = CYL12;
 			sched = &four_stroke[1];
 			sched->coil_cyl = CYL34;
-			state = 3;
+			trim_state = 3;
 			break;
 		}
 		break;
@@ -174,18 +227,168 @@ static void trim_to_sequential(void)
 		 * We know we are not in TDC1 @ 0deg so we must be in TDC1 @ 360deg
 		 * Let's wait for the RPM to recover
 		 */
-		if(r >= min_rpm)
-			state = 4;
+		if(r >= trim_min_rpm)
+			trim_state = 4;
 		break;
 	case 4:
 		tdc1_360deg();
-		state = -1;
+		trim_state = -1;
 		break;
 	default:
 		break;
 	}
 }
 
+/******************************************************************************/
+/* CRANK */
+/******************************************************************************/
+/*
+ * During crank we don't know the phase yet so the fuel is batched on both
+ * cylinders sharing the same TDC. Each injector fires twice per engine cycle
+ * so it gets half of the pulse.
+ */
+#define CRANK_PRIME_MSEC 17
+static int crank_primed;
+static unsigned long crank_start;
+unsigned long time_to_start;
+unsigned short stall_nr;
+
+static void crank_fuel(int x)
+{
+	OS_CPU_SR cpu_sr;
+	unsigned long t = (TICK_PER_MSEC * fuel_msec) >> 1;
+	int a = (x & 1) ? CYL3 : CYL1;
+	int b = (x & 1) ? CYL4 : CYL2;
+
+	OS_ENTER_CRITICAL();
+	io_open_injector(a);
+	io_open_injector(b);
+	io_schedule_close_injector(a, get_monotonic_tick() + t);
+	io_schedule_close_injector(b, get_monotonic_tick() + t);
+	OS_EXIT_CRITICAL();
+}
+
+/* One shot prime pulse on all injectors on the first SYNC */
+static void crank_prime(void)
+{
+	int x;
+	OS_CPU_SR cpu_sr;
+
+	crank_primed = 1;
+	crank_start = curr_time;
+
+	OS_ENTER_CRITICAL();
+	for(x=CYL1; x<=CYL4; x++){
+		io_open_injector(x);
+		io_schedule_close_injector(x, curr_time + (TICK_PER_MSEC * CRANK_PRIME_MSEC));
+	}
+	OS_EXIT_CRITICAL();
+}
+
+static void crank_transition(int old_state)
+{
+	if(engine_state == ENGINE_CRANK && !crank_primed && trigger_wheel_next_period())
+		crank_prime();
+
+	/* Measure the time it takes from the first SYNC to RUN */
+	if(engine_state == ENGINE_RUN && old_state != ENGINE_RUN && crank_primed)
+		time_to_start = (curr_time - crank_start) / TICK_PER_MSEC;
+}
+
+/******************************************************************************/
+/* SPARK RE-ANCHOR */
+/******************************************************************************/
+/*
+ * The spark scheduled in btdc_140() is projected more than 110deg ahead.
+ * On every tooth after that the deadline is projected again from the last
+ * tooth to the target angle so that when the spark fires the projection
+ * is less than 10deg.
+ *
+ * Once the spark is behind us the achieved angle is interpolated between the
+ * two surrounding tooth to report the error in 1/10 deg.
+ */
+#define REANCHOR_MIN_TICK USEC_TO_TICK(4)
+struct spark{
+	unsigned char pending;
+	unsigned char coil;
+	int deg;
+	unsigned long deadline;
+};
+static struct spark spark;
+int reanchor_enabled = 1;
+static int prev_deg, spark_err_max;
+static unsigned long prev_time;
+static long spark_err_sum;
+static unsigned short spark_err_nr;
+
+static void spark_error(int deg)
+{
+	long err, target;
+	unsigned long span = curr_time - prev_time;
+
+	if(!span)
+		return;
+	/* Target from the previous tooth; Behind it when the spark is late */
+	target = normalize_deg(spark.deg - prev_deg);
+	if(target >= (long)DEGREE_PER_ENGINE_CYCLE / 2)
+		target -= DEGREE_PER_ENGINE_CYCLE;
+	/* Achieved angle in 1/10 deg from the previous tooth */
+	err = (long)normalize_deg(deg - prev_deg) * 10L * (long)(spark.deadline - prev_time) / (long)span;
+	err = err - target * 10L;
+	if(err < 0)
+		err = -err;
+	if(err > spark_err_max)
+		spark_err_max = err;
+	spark_err_sum += err;
+	spark_err_nr++;
+	hist_add(HIST_SPARK + spark.coil - CYL1, err);
+}
+
+static void spark_reanchor(void)
+{
+	int deg, r;
+	unsigned long t;
+	OS_CPU_SR cpu_sr;
+
+	deg = event_get_degree();
+	if(!spark.pending)
+		goto out;
+
+	/* Fired since the last tooth */
+	if((long)(curr_time - spark.deadline) >= 0){
+		spark.pending = 0;
+		spark_error(deg);
+		goto out;
+	}
+
+	if(!reanchor_enabled)
+		goto out;
+
+	r = normalize_deg(spark.deg - deg);
+	if(r >= 360) /* Went past the target already; Fire now */
+		r = 0;
+	t = curr_time + deg_to_tick(r);
+	if((long)(t - spark.deadline) < (long)REANCHOR_MIN_TICK && (long)(spark.deadline - t) < (long)REANCHOR_MIN_TICK)
+		goto out;
+
+	OS_ENTER_CRITICAL();
+	timerq_cancel(io_close_coil, spark.coil);
+	io_schedule_close_coil(spark.coil, t);
+	OS_EXIT_CRITICAL();
+	spark.deadline = t;
+out:
+	prev_deg = deg;
+	prev_time = curr_time;
+}
+
+void spark_dump(void)
+{
+	FORCE_PRINT("SPARK ERR %d:%ld\n", spark_err_max, spark_err_nr ? spark_err_sum / spark_err_nr : 0L);
+	spark_err_max = 0;
+	spark_err_sum = 0;
+	spark_err_nr = 0;
+}
+
 /******************************************************************************/
 /* BTDC 140 CYL 1 2 3 4 */
 /******************************************************************************/
@@ -195,22 +398,44 @@ static void btdc_140(struct event *e)
 	OS_CPU_SR cpu_sr;
 	struct engine_schedule *sched = &four_stroke[(int)e->cookie];
 
+	if(engine_state != ENGINE_RUN) /* Cranking dwell starts @40 BTDC */
+		return;
+
 	/* Dwell starts now;
 	 * Max timing advance is 30deg => 110deg from here
 	 * Coils needs 5msec Dwell time so cannot reach 4000RPM
 	 * 	@1000RPM=30deg; @2000RPM=60deg; @4000RPM=120deg
 	 */
-	io_open_coil(sched->coil_cyl, get_monotonic_time());
+	io_open_coil(sched->coil_cyl, get_monotonic_tick());
 
-	if(timing_advance_enabled && timing_advance != 0){
+	if(timing_advance_enabled && spark_advance(sched) != 0){
 		/* Here we project how much time it takes to reach to timing advance point based on the current speed */
-		time = deg_to_usec(140 - timing_advance);
+		time = deg_to_tick(140 - spark_advance(sched));
 		OS_ENTER_CRITICAL();
-		schedule_work_absolute(io_close_coil, sched->coil_cyl, curr_time + time); /* Ignition schedule */
+		io_schedule_close_coil(sched->coil_cyl, curr_time + time); /* Ignition schedule */
 		OS_EXIT_CRITICAL();
+		spark.coil = sched->coil_cyl;
+		spark.deg = normalize_deg(sched->degree - spark_advance(sched));
+		spark.deadline = curr_time + time;
+		spark.pending = 1;
 	}
 }
 
+/******************************************************************************/
+/* BTDC 40 CYL 1 2 3 4 */
+/******************************************************************************/
+static void btdc_40(struct event *e)
+{
+	struct engine_schedule *sched = &four_stroke[(int)e->cookie];
+
+	/* 
+	 * Cranking dwell starts now; The speed is all over the place during crank
+	 * so there is no projection, the spark is fired straight from the BTDC 10 tooth edge
+	 */
+	if(engine_state == ENGINE_CRANK)
+		io_open_coil(sched->coil_cyl, get_monotonic_tick());
+}
+
 /******************************************************************************/
 /* BTDC 10 CYL 1 2 3 4 */
 /******************************************************************************/
@@ -218,8 +443,13 @@ static void btdc_10(struct event *e)
 {
 	struct engine_schedule *sched = &four_stroke[(int)e->cookie];
 
-	if(timing_advance_enabled && timing_advance == 0) /* Default when timing advance is enabled */
-		io_close_coil(sched->coil_cyl, get_monotonic_time());
+	if(engine_state == ENGINE_CRANK){ /* Fixed cranking timing */
+		io_close_coil(sched->coil_cyl, get_monotonic_tick());
+		return;
+	}
+
+	if(timing_advance_enabled && spark_advance(sched) == 0) /* Default when timing advance is enabled */
+		io_close_coil(sched->coil_cyl, get_monotonic_tick());
 }
 
 /******************************************************************************/
@@ -227,36 +457,112 @@ static void btdc_10(struct event *e)
 /******************************************************************************/
 static void btdc_0(struct event *e)
 {
+	unsigned long t;
 	OS_CPU_SR cpu_sr;
 	struct engine_schedule *sched = &four_stroke[(int)e->cookie];
 
 	/* Always close the coil here */
-	io_close_coil(sched->coil_cyl, get_monotonic_time());
+	io_close_coil(sched->coil_cyl, get_monotonic_tick());
+
+	if(engine_state == ENGINE_CRANK){
+		crank_fuel(e->cookie);
+		return;
+	}
+
+	fuel_closed_loop(e->cookie);
+	t = fuel_pulse_tick(fuel_trim[sched->fuel_cyl]);
 
 	OS_ENTER_CRITICAL();
 	io_open_injector(sched->fuel_cyl); /* Now */
-	schedule_work_absolute(io_close_injector, sched->fuel_cyl,  get_monotonic_time() + (USEC_PER_MSEC * fuel_msec)); /* FUEL schedule */
+	io_schedule_close_injector(sched->fuel_cyl,  get_monotonic_tick() + t); /* FUEL schedule */
 	OS_EXIT_CRITICAL();
 
 	if( (e->cookie == 0) && trim_flag ){ /* Trim only from CYL1 */
 		trim_to_sequential();
-#ifdef __ADVANCE_TIMING_TEST__
-		TIMING_DEBUG = curr_time - T1;
-#endif
 	}
 }
 
+/******************************************************************************/
+/* STALL */
+/******************************************************************************/
+/*
+ * Declare a stall when nothing shows up after 3x the expected period of the
+ * next tooth.
+ *
+ * The outputs are closed from the timer queue right on that deadline i.e.
+ * within one missed tooth at any RPM. The OS tick is too coarse for that;
+ * it is rounded up plus 2 ticks so that it always waits at least one full
+ * tick, and at RUN speed it fires a few msec later. That part only moves to
+ * ENGINE_DEAD and re-arms the decoder, the outputs are already off.
+ * A tooth that shows up after the deadline is the first one of a restart.
+ */
+#define STALL_PERIOD_FACTOR 3UL
+static INT32U stall_timeout(void)
+{
+	unsigned long t;
+
+	t = trigger_wheel_next_period();
+	if(!t)
+		return 0; /* Not in SYNC; wait forever */
+	t = (t * STALL_PERIOD_FACTOR) / (TICK_PER_SEC / OS_TICKS_PER_SEC);
+	return t + 2;
+}
+
+static volatile unsigned char stalled;
+
+/* Timer queue */
+static void stall_expire(int arg, unsigned long t)
+{
+	close_engine_io();
+	stalled = 1;
+}
+
+static void stall_arm(void)
+{
+	unsigned long t;
+	OS_CPU_SR cpu_sr;
+
+	t = trigger_wheel_next_period();
+	OS_ENTER_CRITICAL();
+	timerq_cancel(stall_expire, 0);
+	if(t)
+		timerq_add(stall_expire, 0, curr_time + t * STALL_PERIOD_FACTOR, 0);
+	OS_EXIT_CRITICAL();
+}
+
+static void engine_stall(void)
+{
+	OS_CPU_SR cpu_sr;
+
+	OS_ENTER_CRITICAL();
+	timerq_cancel(stall_expire, 0);
+	stalled = 0;
+	OS_EXIT_CRITICAL();
+	close_engine_io();
+	trigger_wheel_reset();
+	event_reset();
+	trim_reset(); /* Phase is unknown again */
+	crank_primed = 0;
+	spark.pending = 0;
+	stall_nr++;
+	engine_state = ENGINE_DEAD;
+	trace_record(TRACE_STATE, 0, engine_state, 0);
+	mgmt_post(MGMT_STATE);
+}
+
 void engine_thread(void *p)
 {
-	int x, init = 0;
+	int x;
 	INT8U err;
 	OS_CPU_SR cpu_sr;
 	unsigned long t;
 
 	event_init(DEGREE_PER_ENGINE_CYCLE / TRIGGER_WHEEL_RESOLUTION);
+	fuel_init();
 
 	for(x=0; x<4; x++){
 		event_register(normalize_deg(four_stroke[x].degree - 140), btdc_140, x);
+		event_register(normalize_deg(four_stroke[x].degree - 40), btdc_40, x);
 		event_register(normalize_deg(four_stroke[x].degree - 10), btdc_10, x);
 		event_register(normalize_deg(four_stroke[x].degree - 0), btdc_0, x);
 	}
@@ -268,43 +574,51 @@ void engine_thread(void *p)
 	trigger_wheel_init();
 	
 	engine_state = ENGINE_STOP;
+	mgmt_post(MGMT_STATE);
 
 	while(1){
 		/* 
 		 * Wait for the trigger wheel notification
-		 * When the engine has started running wait on the semaphore with a timeout so that we can 
-		 * catch the scenario where the engine stops
+		 * Once in SYNC wait on the semaphore with a timeout based on the next expected tooth
+		 * so that we can catch the scenario where the engine stops. Then close everything
+		 * and re-arm the trigger wheel for a restart.
 		 */
-		if(engine_state == ENGINE_RUN || init == 1){
-			OSSemPend(engine_event, 100, &err);
-			if(err == OS_ERR_TIMEOUT){
-				DIE(-1);
-			}
-			init = 1;
+		OSSemPend(engine_event, stall_timeout(), &err);
+		if(err == OS_ERR_TIMEOUT){
+			engine_stall();
+			continue;
 		}
-		else
-			OSSemPend(engine_event, 0, &err);
 
 		/* Capture the crank period */
 		OS_ENTER_CRITICAL();	
 		t = capture_t;
 		capture_t = 0;
 		OS_EXIT_CRITICAL();
+		if(stalled)
+			engine_stall();
 
 		/* Run the state machine for this engine type */
+		x = engine_state;
 		engine_state = run_trigger_wheel(t);
+		if(engine_state == ENGINE_DEAD){ /* Decoder saw the engine stopping */
+			engine_state = x;
+			engine_stall();
+			continue;
+		}
+		if(engine_state != x){
+			trace_record(TRACE_STATE, 0, engine_state, 0);
+			mgmt_post(MGMT_STATE);
+		}
+		crank_transition(x);
+		stall_arm();
 
 		/* Process the event callback */
 		event_callback();
-#ifdef __LOOP_TIMING_TEST__
-		{
-			t = get_monotonic_time();
-			t = t - curr_time;
-			if(t>100)
-				FORCE_PRINT("%ld\n", t);
-		}
 
-#endif
+		/* Project the pending spark again from this tooth */
+		if(engine_state == ENGINE_RUN)
+			spark_reanchor();
+
+		hist_add(HIST_LOOP, get_monotonic_tick() - curr_time);
 	}
 }
-
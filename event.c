@@ -17,7 +17,7 @@
 //#define USE_MALLOC
 	
 #define EVENT_TABLE_SIZE ( DEGREE_PER_ENGINE_CYCLE / TRIGGER_WHEEL_RESOLUTION)
-#define MAX_EVENT 12
+#define MAX_EVENT 16
 #ifdef USE_MALLOC
 static struct event **event_table;
 #else
@@ -26,7 +26,7 @@ static struct event *event_table[EVENT_TABLE_SIZE];
 #endif
 static int event_table_entry_nr;
 
-static volatile unsigned char event_index, pending_event;
+static volatile unsigned char event_index, pending_event, tooth_index;
 
 void event_register(int degree, fcn_t fcn, unsigned char cookie)
 {
@@ -64,12 +64,19 @@ void event_callback(void)
 	if(pending_event == 0xff)
 		return;
 	e = event_table[pending_event]; 
+	hist_add(HIST_LATENCY, get_monotonic_tick() - curr_time);
+	if(record_mode)
+		toothlog_event(e->cookie, pending_event);
+	trace_record(TRACE_EVENT, e->cookie, (pending_event * TRIGGER_WHEEL_RESOLUTION) >> 8,
+		pending_event * TRIGGER_WHEEL_RESOLUTION);
 	e->fcn(e);
 	pending_event = 0xff; /* ACK we are done processing the event */
 }
 
 void event_tick(int flag)
 {
+	if(flag >= 0)
+		tooth_index = event_index; /* Last real tooth */
 	if(event_table[event_index]){
 		if(flag < 0)
 			DIE(EVENT);
@@ -83,6 +90,12 @@ void event_tick(int flag)
 		event_index++;
 }
 
+/* Angle of the last real tooth */
+int event_get_degree(void)
+{
+	return tooth_index * TRIGGER_WHEEL_RESOLUTION;
+}
+
 void event_set_position(int pos)
 {
 	if(pos >= event_table_entry_nr)
@@ -90,6 +103,14 @@ void event_set_position(int pos)
 	event_index = pos;
 }
 
+/* Drop any pending event and wait for a new SYNC */
+void event_reset(void)
+{
+	event_index = 0;
+	tooth_index = 0;
+	pending_event = 0xff;
+}
+
 void event_init(int size)
 {
 	if(size != EVENT_TABLE_SIZE)
@@ -0,0 +1,261 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+
+/*
+ * Closed loop fuel based on a wideband O2 controller
+ *
+ * The wideband analog output is linear 0-5V ==> AFR 10-20
+ *	14.7 AFR ==> (14.7 - 10) / 10 * 1023 = 481; ~10 count per 0.1 AFR
+ *
+ * All the trims are in 1/256 of the base pulse.
+ *
+ * Short term trim (STFT) is an integrator updated once per engine cycle;
+ * The O2 reading lags the injection by the exhaust transport delay so a
+ * faster update only hunts. The accumulator keeps 1/256 of a trim step so
+ * a small error still adds up instead of truncating to 0; A full scale
+ * error takes about 35 engine cycles to reach STFT_LIMIT.
+ * Once STFT drifts by more than LTFT_LEARN the long term trim (LTFT) cell
+ * for the current RPM / Load is moved by one and the same amount is taken
+ * out of STFT so the total correction doesn't change. Everything is O(1).
+ *
+ * The LTFT table is saved in NVRAM one dirty cell at a time from the
+ * management thread. On a blank NVRAM the magic goes last, once every cell
+ * made it, so that a reset in the middle doesn't load 0xff cells.
+ */
+#define EGO_STOICH 481
+#define EGO_MIN 20 /* Sensor not ready OR disconnected */
+#define EGO_MAX 1003
+#define STFT_GAIN 1 /* 1/256 trim step per EGO count per engine cycle */
+#define STFT_FRAC 256
+#define STFT_LIMIT 64 /* +-25% */
+#define LTFT_LEARN 8 /* ~3% */
+#define LTFT_LIMIT 127
+
+#define RPM_CELL 8 /* 1000 RPM per cell */
+#define LOAD_CELL 8 /* MAP >> 7 */
+
+#define NVRAM_MAGIC 0xA5
+#define NVRAM_MAGIC_OFFSET 0
+#define NVRAM_LTFT_OFFSET 1
+
+int closed_loop = 0;
+static int stft;
+static long stft_acc; /* STFT in 1/STFT_FRAC */
+static signed char ltft[RPM_CELL][LOAD_CELL];
+static unsigned char dirty[RPM_CELL]; /* One bit per LOAD_CELL */
+static unsigned char cell_rpm, cell_load;
+static unsigned char pump_duty;
+static unsigned char magic_pending;
+
+/*
+ * trim is the per cylinder trim; When all the trims are 0 this is only
+ * a compare on top of the base pulse.
+ */
+unsigned long fuel_pulse_tick(int trim)
+{
+	long base = TICK_PER_MSEC * fuel_msec;
+
+	if(closed_loop)
+		trim += stft + ltft[cell_rpm][cell_load];
+	if(!trim)
+		return base;
+	return base + ((base * trim) / 256);
+}
+
+/* Called from the TDC event of every cylinder */
+void fuel_closed_loop(int cookie)
+{
+	int err, r;
+	unsigned short ego;
+	signed char *cell;
+
+	if(!closed_loop || engine_state != ENGINE_RUN)
+		return;
+
+	/* Once per engine cycle */
+	if(cookie != 0)
+		return;
+
+	r = get_rpm() / 1000;
+	cell_rpm = (r >= RPM_CELL) ? RPM_CELL - 1 : r;
+	cell_load = adc_get(ADC_MAP) >> 7;
+
+	ego = adc_get(ADC_EGO);
+	if(ego < EGO_MIN || ego > EGO_MAX)
+		return;
+
+	/* Lean is positive ==> more fuel */
+	err = (int)ego - EGO_STOICH;
+	stft_acc += (long)err * STFT_GAIN;
+	if(stft_acc > (long)STFT_LIMIT * STFT_FRAC)
+		stft_acc = (long)STFT_LIMIT * STFT_FRAC;
+	if(stft_acc < -(long)STFT_LIMIT * STFT_FRAC)
+		stft_acc = -(long)STFT_LIMIT * STFT_FRAC;
+	stft = stft_acc / STFT_FRAC;
+
+	cell = &ltft[cell_rpm][cell_load];
+	if(stft > LTFT_LEARN && *cell < LTFT_LIMIT){
+		(*cell)++;
+		stft_acc -= STFT_FRAC;
+		stft--;
+	}
+	else if(stft < -LTFT_LEARN && *cell > -LTFT_LIMIT){
+		(*cell)--;
+		stft_acc += STFT_FRAC;
+		stft++;
+	}
+	else
+		return;
+	dirty[cell_rpm] |= 1 << cell_load;
+}
+
+/* Save one dirty cell; Then the magic when pending */
+void fuel_persist(void)
+{
+	OS_CPU_SR cpu_sr;
+	static unsigned char r = 0;
+	unsigned char l, x;
+
+	for(x=0; x<RPM_CELL; x++){
+		r = (r + 1) & (RPM_CELL - 1);
+		if(dirty[r])
+			break;
+	}
+	if(!dirty[r]){
+		if(magic_pending && !nvram_write_byte(NVRAM_MAGIC_OFFSET, NVRAM_MAGIC))
+			magic_pending = 0;
+		return;
+	}
+	for(l=0; l<LOAD_CELL; l++){
+		if(dirty[r] & (1<<l))
+			break;
+	}
+
+	/* Clear first so that a concurrent update is caught on the next pass */
+	OS_ENTER_CRITICAL();
+	dirty[r] &= ~(1<<l);
+	OS_EXIT_CRITICAL();
+	if(nvram_write_byte(NVRAM_LTFT_OFFSET + (r * LOAD_CELL) + l, ltft[r][l]) < 0){
+		OS_ENTER_CRITICAL();
+		dirty[r] |= 1<<l;
+		OS_EXIT_CRITICAL();
+	}
+}
+
+void fuel_dump(void)
+{
+	int r, l;
+
+	FORCE_PRINT("PUMP %d STFT %d\n", pump_duty, stft);
+	for(r=0; r<RPM_CELL; r++){
+		for(l=0; l<LOAD_CELL; l++)
+			FORCE_PRINT("%4d", ltft[r][l]);
+		FORCE_PRINT("\n");
+	}
+}
+
+/******************************************************************************/
+/* Fuel pump */
+/******************************************************************************/
+/*
+ * The pump runs off a hardware PWM so the flow follows the demand:
+ *	injector duty = pulse / engine cycle = pulse * RPM / 120 sec
+ * scaled in 1/256 and mapped on top of a floor that holds the rail
+ * pressure at idle. Full flow while cranking, off when the engine is dead.
+ */
+#define PUMP_DUTY_MIN 96 /* ~38% */
+#define PUMP_DUTY_MAX 255
+#define INJ_DUTY_DIV (120UL * TICK_PER_SEC / 256)
+
+/* Called from the management thread */
+void fuel_pump_update(int on)
+{
+	unsigned long d;
+
+	if(!on || engine_state == ENGINE_DEAD)
+		d = 0;
+	else if(engine_state == ENGINE_CRANK)
+		d = PUMP_DUTY_MAX;
+	else if(engine_state == ENGINE_RUN){
+		d = (fuel_pulse_tick(0) * get_rpm()) / INJ_DUTY_DIV;
+		if(d > 255)
+			d = 255;
+		d = PUMP_DUTY_MIN + ((d * (PUMP_DUTY_MAX - PUMP_DUTY_MIN)) >> 8);
+	}
+	else
+		d = PUMP_DUTY_MIN;
+
+	if(d == pump_duty)
+		return;
+	pump_duty = d;
+	if(d)
+		gaz_relay_on();
+	else
+		gaz_relay_off();
+	pump_pwm_platform(d);
+}
+
+/*
+ * Host access to the LTFT table; offset / len are in cell, row major.
+ * A write goes to NVRAM like a learned cell.
+ */
+int fuel_table_read(int offset, signed char *buf, int len)
+{
+	OS_CPU_SR cpu_sr;
+
+	if(offset < 0 || len < 0 || offset + len > (int)sizeof(ltft))
+		return -1;
+	OS_ENTER_CRITICAL();
+	memcpy(buf, &ltft[0][0] + offset, len);
+	OS_EXIT_CRITICAL();
+	return len;
+}
+
+int fuel_table_write(int offset, const signed char *buf, int len)
+{
+	int x, c;
+	OS_CPU_SR cpu_sr;
+
+	if(offset < 0 || len < 0 || offset + len > (int)sizeof(ltft))
+		return -1;
+	OS_ENTER_CRITICAL();
+	for(x=0; x<len; x++){
+		c = offset + x;
+		ltft[c / LOAD_CELL][c % LOAD_CELL] = buf[x];
+		dirty[c / LOAD_CELL] |= 1 << (c % LOAD_CELL);
+	}
+	OS_EXIT_CRITICAL();
+	return len;
+}
+
+void fuel_init(void)
+{
+	unsigned char magic;
+
+	stft = 0;
+	stft_acc = 0;
+	nvram_read(&magic, NVRAM_MAGIC_OFFSET, 1);
+	if(magic == NVRAM_MAGIC){
+		nvram_read(ltft, NVRAM_LTFT_OFFSET, sizeof(ltft));
+		memset(dirty, 0, sizeof(dirty));
+		magic_pending = 0;
+		return;
+	}
+	/* Blank NVRAM; Start from scratch and save everything */
+	memset(ltft, 0, sizeof(ltft));
+	memset(dirty, 0xff, sizeof(dirty));
+	magic_pending = 1;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+
+/******************************************************************************/
+/* Latency histograms */
+/******************************************************************************/
+/*
+ * Always built in; One add is a few shifts and an increment.
+ * Bucket 0 is 0 and bucket n is [2^(n-1), 2^n); The last one takes everything above.
+ * The counters are 8 bit to fit the 328. When one saturates the whole histogram
+ * is halved so the shape is kept and the recent samples weigh more.
+ */
+static unsigned char hist[HIST_NR][HIST_BUCKET];
+
+void hist_add(int h, unsigned long v)
+{
+	unsigned char b = 0, x;
+	OS_CPU_SR cpu_sr;
+
+	while(v && b < HIST_BUCKET - 1){
+		v >>= 1;
+		b++;
+	}
+
+	OS_ENTER_CRITICAL();
+	if(hist[h][b] == 0xff){
+		for(x=0; x<HIST_BUCKET; x++)
+			hist[h][x] >>= 1;
+	}
+	hist[h][b]++;
+	OS_EXIT_CRITICAL();
+}
+
+static const char *hist_name(int h)
+{
+	if(h == HIST_LATENCY)
+		return "LAT";
+	if(h == HIST_LOOP)
+		return "LOOP";
+	if(h == HIST_ACTION)
+		return "ACTION";
+	if(h < HIST_SPARK)
+		return "DWELL";
+	if(h < HIST_INJ)
+		return "SPARK";
+	return "INJ";
+}
+
+/* Output group of a per cylinder histogram; 12 and 34 are the wasted spark pairs */
+static int hist_cyl(int h)
+{
+	static const unsigned char coil[CYL34 + 1] = { 0, 1, 2, 3, 4, 12, 34 };
+
+	if(h < HIST_DWELL)
+		return 0;
+	if(h < HIST_SPARK)
+		return coil[h - HIST_DWELL + CYL1];
+	if(h < HIST_INJ)
+		return coil[h - HIST_SPARK + CYL1];
+	return h - HIST_INJ + CYL1;
+}
+
+/*
+ * One line per histogram that saw something then clear
+ * Each bucket is printed as upper_bound:count; usec except SPARK in 1/10 deg
+ */
+void hist_dump(void)
+{
+	int h, x;
+	unsigned long b;
+	unsigned char snap[HIST_BUCKET];
+	OS_CPU_SR cpu_sr;
+
+	for(h=0; h<HIST_NR; h++){
+		OS_ENTER_CRITICAL();
+		memcpy(snap, hist[h], HIST_BUCKET);
+		memset(hist[h], 0, HIST_BUCKET);
+		OS_EXIT_CRITICAL();
+
+		for(x=0; x<HIST_BUCKET; x++){
+			if(snap[x])
+				break;
+		}
+		if(x == HIST_BUCKET)
+			continue;
+
+		FORCE_PRINT("%s%d", hist_name(h), hist_cyl(h));
+		for(x=0; x<HIST_BUCKET; x++){
+			if(!snap[x])
+				continue;
+			b = x ? 1UL << x : 0; /* Upper bound; Everything in the last one */
+			if(h < HIST_SPARK || h >= HIST_INJ)
+				b = TICK_TO_USEC(b);
+			FORCE_PRINT(" %s%lu:%d", x == HIST_BUCKET - 1 ? ">" : "", x == HIST_BUCKET - 1 ? b >> 1 : b, snap[x]);
+		}
+		FORCE_PRINT("\n");
+	}
+}
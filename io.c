@@ -0,0 +1,327 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+#include <io.h>
+
+/******************************************************************************/
+/* Pin descriptor ==> port mask */
+/******************************************************************************/
+/*
+ * Everything below is a compile time constant; The masks of a group are
+ * folded per port and the ports a group doesn't touch are compiled out.
+ * On the 328 a group is one table load and one read-modify-write of PORTx
+ * under the IRQ hold off. The cost against the hand written version is
+ * counted from the code, not measured; make -C tools/simavr compare.
+ */
+#define PIN_ON(pin, p) (((pin##_PORT) == IO_PORT_##p) ? (pin##_BIT) : 0)
+
+#define INJ_PORT_MASK(p) \
+	(PIN_ON(INJ1, p) | PIN_ON(INJ2, p) | PIN_ON(INJ3, p) | PIN_ON(INJ4, p))
+#define COIL_PORT_MASK(p) \
+	(PIN_ON(COIL1, p) | PIN_ON(COIL2, p) | PIN_ON(COIL3, p) | PIN_ON(COIL4, p))
+#define MISC_PORT_MASK(p) \
+	(PIN_ON(RELAY, p) | PIN_ON(GAZ, p) | PIN_ON(STARTER, p))
+
+/* Logical output group ==> mask of each port */
+#define DECLARE_GROUP_MASK(p, arg) \
+static const unsigned char inj_mask_##p[CYL4 + 1] = { \
+	[CYL1] = PIN_ON(INJ1, p), \
+	[CYL2] = PIN_ON(INJ2, p), \
+	[CYL3] = PIN_ON(INJ3, p), \
+	[CYL4] = PIN_ON(INJ4, p), \
+}; \
+static const unsigned char coil_mask_##p[CYL34 + 1] = { \
+	[CYL1] = PIN_ON(COIL1, p), \
+	[CYL2] = PIN_ON(COIL2, p), \
+	[CYL3] = PIN_ON(COIL3, p), \
+	[CYL4] = PIN_ON(COIL4, p), \
+	[CYL12] = PIN_ON(COIL1, p) | PIN_ON(COIL2, p), /* Wasted spark pair */ \
+	[CYL34] = PIN_ON(COIL3, p) | PIN_ON(COIL4, p), \
+};
+IO_FOR_EACH_PORT(DECLARE_GROUP_MASK, 0)
+
+#define INJ_WRITE(p, op) \
+	if(INJ_PORT_MASK(p)) IO_PORT_##op(p, inj_mask_##p[inj]);
+#define COIL_WRITE(p, op) \
+	if(COIL_PORT_MASK(p)) IO_PORT_##op(p, coil_mask_##p[coil]);
+
+#define _PIN_WRITE(p, op, pin) \
+	if(PIN_ON(pin, p)) IO_PORT_##op(p, PIN_ON(pin, p));
+#define _PIN_SET(p, pin) _PIN_WRITE(p, SET, pin)
+#define _PIN_CLR(p, pin) _PIN_WRITE(p, CLR, pin)
+#define PIN_ACTIVE(pin) do { \
+	if(pin##_ACTIVE_LOW) { IO_FOR_EACH_PORT(_PIN_CLR, pin) } \
+	else { IO_FOR_EACH_PORT(_PIN_SET, pin) } \
+} while(0)
+#define PIN_INACTIVE(pin) do { \
+	if(pin##_ACTIVE_LOW) { IO_FOR_EACH_PORT(_PIN_SET, pin) } \
+	else { IO_FOR_EACH_PORT(_PIN_CLR, pin) } \
+} while(0)
+
+#define _ALL_CLR(p, arg) \
+	if(INJ_PORT_MASK(p) | COIL_PORT_MASK(p)) \
+		IO_PORT_CLR(p, INJ_PORT_MASK(p) | COIL_PORT_MASK(p));
+#define _CFG_OUTPUT(p, arg) \
+	if(INJ_PORT_MASK(p) | COIL_PORT_MASK(p) | MISC_PORT_MASK(p)) \
+		IO_CFG_OUTPUT(p, INJ_PORT_MASK(p) | COIL_PORT_MASK(p) | MISC_PORT_MASK(p));
+
+#define BAD_INJ(x) ((unsigned int)(x) - CYL1 > CYL4 - CYL1)
+#define BAD_COIL(x) ((unsigned int)(x) - CYL1 > CYL34 - CYL1)
+
+/*
+ * Pending close of each output; Only those feed the histograms.
+ * Updated from the engine thread and the timer queue IRQ; Under critical section.
+ */
+static unsigned char inj_pending, coil_pending;
+static unsigned char prime_owner, prime_inj; /* Injector held by the priming and the one in progress */
+static unsigned long inj_deadline[CYL4 + 1];
+static unsigned long coil_open_t[CYL34 + 1];
+
+/******************************************************************************/
+/* Injector */
+/******************************************************************************/
+void io_open_injector(int inj)
+{
+	if(BAD_INJ(inj))
+		DIE(FATAL);
+	IO_OPEN_INJECTOR_HOOK(inj);
+	IO_FOR_EACH_PORT(INJ_WRITE, SET)
+	if(record_mode)
+		toothlog_output(inj, 0, 1);
+//	PRINT("INJ ON %d \n", inj);
+}
+
+void io_close_injector(int inj, unsigned long t)
+{
+	OS_CPU_SR cpu_sr;
+	unsigned char pending, open;
+
+	if(BAD_INJ(inj))
+		DIE(FATAL);
+	IO_CLOSE_INJECTOR_HOOK(inj);
+	IO_FOR_EACH_PORT(INJ_WRITE, CLR)
+	OS_ENTER_CRITICAL();
+	pending = inj_pending & (1 << inj);
+	open = (inj_pending | prime_owner) & (1 << inj); /* Engine pulse OR prime pulse */
+	inj_pending &= ~(1 << inj);
+	t = t - inj_deadline[inj];
+	OS_EXIT_CRITICAL();
+	if(open && record_mode)
+		toothlog_output(inj, 0, 0);
+	if(pending)
+		hist_add(HIST_INJ + inj - CYL1, (long)t < 0 ? -t : t);
+//	PRINT("INJ OFF %d \n", inj);
+}
+
+/* Called with IRQ disabled */
+void io_schedule_close_injector(int inj, unsigned long t)
+{
+	if(BAD_INJ(inj))
+		DIE(FATAL);
+	inj_pending |= 1 << inj;
+	inj_deadline[inj] = t;
+	prime_owner &= ~(1 << inj); /* The engine takes over */
+	timerq_add(io_close_injector, inj, t, inj);
+}
+
+/******************************************************************************/
+/* Injector priming */
+/******************************************************************************/
+/*
+ * One injector after the other through the timer queue; Nothing blocks.
+ * The engine owns an injector while it has a pulse pending:
+ *	- An injector busy with the engine is skipped; It is getting fuel anyway
+ *	- The engine can take over an injector in the middle of its prime pulse;
+ *	  The close is then left to the engine schedule
+ * A pulse of 0 skips that injector.
+ */
+unsigned char prime_msec[CYL4] = { PRIME_MSEC, PRIME_MSEC, PRIME_MSEC, PRIME_MSEC };
+
+static void prime_close(int inj, unsigned long t);
+
+/* Called with IRQ disabled */
+static void prime_next(unsigned long t)
+{
+	while(++prime_inj <= CYL4){
+		if((inj_pending & (1 << prime_inj)) || !prime_msec[prime_inj - CYL1])
+			continue;
+		io_open_injector(prime_inj);
+		prime_owner = 1 << prime_inj;
+		timerq_add(prime_close, prime_inj, t + TICK_PER_MSEC * prime_msec[prime_inj - CYL1], 0);
+		return;
+	}
+	prime_inj = 0; /* Done */
+}
+
+/* Timer queue */
+static void prime_close(int inj, unsigned long t)
+{
+	if(prime_owner & (1 << inj))
+		io_close_injector(inj, t);
+	prime_owner = 0;
+	prime_next(t);
+}
+
+/* -1 when already priming */
+int prime_start(void)
+{
+	OS_CPU_SR cpu_sr;
+	int r = -1;
+
+	OS_ENTER_CRITICAL();
+	if(!prime_inj){
+		prime_inj = CYL1 - 1;
+		prime_next(get_monotonic_tick());
+		r = 0;
+	}
+	OS_EXIT_CRITICAL();
+	return r;
+}
+
+void prime_cancel(void)
+{
+	OS_CPU_SR cpu_sr;
+
+	OS_ENTER_CRITICAL();
+	if(prime_inj){
+		timerq_cancel(prime_close, prime_inj);
+		if(prime_owner)
+			io_close_injector(prime_inj, get_monotonic_tick());
+		prime_owner = 0;
+		prime_inj = 0;
+	}
+	OS_EXIT_CRITICAL();
+}
+
+int prime_busy(void)
+{
+	return prime_inj != 0;
+}
+
+/******************************************************************************/
+/* Coil */
+/******************************************************************************/
+void io_open_coil(int coil, unsigned long t)
+{
+	OS_CPU_SR cpu_sr;
+
+	if(BAD_COIL(coil))
+		DIE(FATAL);
+	IO_OPEN_COIL_HOOK(coil);
+	IO_FOR_EACH_PORT(COIL_WRITE, SET)
+	if(record_mode)
+		toothlog_output(coil, 1, 1);
+	OS_ENTER_CRITICAL();
+	coil_pending |= 1 << coil;
+	coil_open_t[coil] = t;
+	OS_EXIT_CRITICAL();
+//	PRINT("COIL ON %d \n", coil);
+}
+
+void io_close_coil(int coil, unsigned long t)
+{
+	OS_CPU_SR cpu_sr;
+	unsigned char pending;
+
+	if(BAD_COIL(coil))
+		DIE(FATAL);
+	IO_FOR_EACH_PORT(COIL_WRITE, CLR)
+	OS_ENTER_CRITICAL();
+	pending = coil_pending & (1 << coil);
+	coil_pending &= ~(1 << coil);
+	t = t - coil_open_t[coil];
+	OS_EXIT_CRITICAL();
+	if(pending){
+		if(record_mode)
+			toothlog_output(coil, 1, 0);
+		hist_add(HIST_DWELL + coil - CYL1, t);
+	}
+//	PRINT("COIL OFF %d \n", coil);
+}
+
+/******************************************************************************/
+/* Relay */
+/******************************************************************************/
+void io_relay_off(void)
+{
+	PIN_INACTIVE(RELAY);
+}
+
+void io_relay_on(void)
+{
+	PIN_ACTIVE(RELAY);
+}
+
+/******************************************************************************/
+/* Starter */
+/******************************************************************************/
+void starter_off(void)
+{
+	PIN_INACTIVE(STARTER);
+}
+
+void starter_on(void)
+{
+	PIN_ACTIVE(STARTER);
+}
+
+/******************************************************************************/
+/* GAZ Pump */
+/******************************************************************************/
+void gaz_relay_off(void)
+{
+//	PRINT("Gaz OFF\n");
+	PIN_INACTIVE(GAZ);
+}
+
+void gaz_relay_on(void)
+{
+//	PRINT("Gaz ON\n");
+	PIN_ACTIVE(GAZ);
+}
+
+/******************************************************************************/
+/* Initialization */
+/******************************************************************************/
+/* Injectors and coils only; relays are left alone so that we can restart */
+void close_engine_io(void)
+{
+	OS_CPU_SR cpu_sr;
+
+	prime_cancel();
+	IO_FOR_EACH_PORT(_ALL_CLR, 0)
+	OS_ENTER_CRITICAL();
+	inj_pending = 0;
+	coil_pending = 0;
+	OS_EXIT_CRITICAL();
+}
+
+void close_all_io(void)
+{
+	gaz_relay_off();
+	io_relay_off();
+	close_engine_io();
+	starter_off();
+	pump_pwm_platform(0);
+	adc_stop_platform();
+}
+
+void io_init(void)
+{
+	IO_FOR_EACH_PORT(_CFG_OUTPUT, 0)
+	close_all_io();
+	io_init_platform();
+	adc_init();
+}
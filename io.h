@@ -0,0 +1,30 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __IO_H_
+#define __IO_H_
+
+/*
+ * Per platform register accessors and pin descriptor used by the IO core
+ * in io.c; Nothing else should include this.
+ */
+#if defined(__AVR__)
+#include <arch/avr/io_mega328.h>
+#elif defined(__arm__) || defined(__aarch64__)
+#include <arch/arm/io_arm.h>
+#else
+#include <arch/x86/io_x86.h>
+#endif
+
+#endif
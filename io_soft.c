@@ -0,0 +1,211 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+#include <io.h>
+
+/*
+ * Shared by the platforms without hardware to drive; See arch/io_soft.h
+ */
+#ifdef __IO_SOFT__
+
+/******************************************************************************/
+/* Input */
+/******************************************************************************/
+#ifdef __PLANT__
+#define CRANK_VAL() plant_crank_level()
+#else
+#define CRANK_VAL() 0
+#endif
+//#define CAM_VAL() 0
+
+/******************************************************************************/
+/* Output compare */
+/******************************************************************************/
+/*
+ * No output compare on this platform; The timer queue runs on the software timer
+ *
+ * The software timer can't be cancelled so only one is armed at a time and
+ * timerq_expire() re-arms it for the next head. A new head that is earlier
+ * arms a new one and the previous one is stale; It does nothing when it
+ * fires, otherwise each of them would re-arm and they would pile up.
+ */
+static unsigned long armed;
+static unsigned int armed_gen;
+static unsigned char armed_on;
+
+static void timerq_work(int arg, unsigned long t)
+{
+	if((unsigned int)arg != armed_gen) /* Stale */
+		return;
+	armed_on = 0;
+	timerq_expire();
+}
+
+void timerq_init_platform(void)
+{
+	armed_on = 0;
+	armed_gen++;
+}
+
+/* Called with IRQ disabled */
+void timerq_arm_platform(unsigned long deadline, int edge)
+{
+	if(armed_on && (long)(deadline - armed) >= 0)
+		return; /* Fires first and re-arms from there */
+	armed = deadline;
+	armed_on = 1;
+	armed_gen++;
+	io_schedule_tick(timerq_work, armed_gen, deadline);
+}
+
+void io_schedule_close_coil(int coil, unsigned long t)
+{
+	timerq_add(io_close_coil, coil, t, 0);
+}
+
+void io_dump(void)
+{
+#ifdef __PLANT__
+	plant_dump();
+#endif
+}
+
+/******************************************************************************/
+/* TRIGGER WHEEL */
+/******************************************************************************/
+static volatile unsigned long old_time = 0;
+void fake_irq(void)
+{
+	portSAVE_CONTEXT();
+
+	if(!CRANK_VAL()) /* Not interested in the Falling edge signal */
+		goto out;
+
+	OSIntEnter();
+	if(capture_t) /* Running behind */
+		DIE(IRQ);
+
+	curr_time = get_monotonic_tick();
+	capture_t = curr_time - old_time;
+	old_time = curr_time;
+	trace_record(TRACE_CRANK, 0, 0, 0);
+
+	OSSemPost(engine_event); /* Signal the engine_thread */
+
+	OSIntExit();
+
+out:
+	portRESTORE_CONTEXT();
+}
+
+void trigger_wheel_init_platform(void)
+{
+	capture_t = 0;
+#ifdef __PLANT__
+	/* From the engine thread; The timer work is running by now */
+	plant_init();
+#endif
+}
+
+/******************************************************************************/
+/* ADC */
+/******************************************************************************/
+/* No analog input on this platform */
+void adc_init_platform(void)
+{
+}
+
+int adc_start_platform(int ch)
+{
+	return -1;
+}
+
+void adc_stop_platform(void)
+{
+}
+
+/******************************************************************************/
+/* Fuel pump */
+/******************************************************************************/
+void pump_pwm_platform(unsigned char duty)
+{
+	trace_record(TRACE_PUMP, 0, duty, 0);
+}
+
+/******************************************************************************/
+/* NVRAM */
+/******************************************************************************/
+/* Nothing persistent on this platform; Look like an erased EEPROM */
+void nvram_read(void *dst, int offset, int len)
+{
+	memset(dst, 0xff, len);
+}
+
+int nvram_write_byte(int offset, unsigned char b)
+{
+	return 0;
+}
+
+/******************************************************************************/
+/* Console */
+/******************************************************************************/
+/* The lib console is buffered by the OS on this platform */
+void console_init(void)
+{
+}
+
+int console_getc(void)
+{
+	if(!USART_data_available())
+		return -1;
+	return getchar();
+}
+
+#ifdef __KERNEL__
+/* No byte stream to the host from the kernel; The binary frames are not sent */
+void console_putc(unsigned char c)
+{
+}
+
+void console_flush(void)
+{
+}
+
+int console_tx_room(void)
+{
+	return 0;
+}
+#else
+void console_putc(unsigned char c)
+{
+	putchar(c);
+}
+
+void console_flush(void)
+{
+	fflush(stdout);
+}
+
+int console_tx_room(void)
+{
+	return CONSOLE_TX_UNBOUNDED;
+}
+#endif
+
+void console_dump(void)
+{
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+
+/******************************************************************************/
+/* Deferred log */
+/******************************************************************************/
+#ifdef __LOG_DEFERRED__
+/*
+ * A message is its id followed by each argument in zigzag varint; It is built
+ * on the stack then copied in the ring under critical section so any context
+ * can log. When the ring is full the message is dropped and counted, the count
+ * goes out as LOG_DROP once there is room again.
+ *
+ * The management thread drains the ring to the UART, see tools/logrender.py
+ *	SOF TYPE LEN { message } SUM
+ * SUM is the 8 bit sum of everything after SOF. Same framing as the tooth log.
+ */
+#define LOG_SIZE 64 /* Power of 2 and <= 128 with free running byte index */
+#define LOG_MASK (LOG_SIZE - 1)
+#define LOG_SOF 0xa5
+#define LOG_TYPE 'L'
+#define LOG_MSG_MAX (1 + 2 * 5)
+
+#define LOG_ARG(id, n, fmt) n,
+static const unsigned char log_arg[LOG_NR] = {
+	LOG_TABLE(LOG_ARG)
+};
+
+static unsigned char ring[LOG_SIZE];
+static volatile unsigned char head, tail;
+static unsigned short dropped;
+
+static unsigned char *put_zigzag(unsigned char *p, long v)
+{
+	unsigned long z = v < 0 ? ((unsigned long)-v << 1) - 1 : (unsigned long)v << 1;
+
+	while(z >= 0x80){
+		*p++ = z | 0x80;
+		z >>= 7;
+	}
+	*p++ = z;
+	return p;
+}
+
+static unsigned char *build(unsigned char *p, unsigned char id, long a, long b)
+{
+	*p++ = id;
+	if(log_arg[id] > 0)
+		p = put_zigzag(p, a);
+	if(log_arg[id] > 1)
+		p = put_zigzag(p, b);
+	return p;
+}
+
+/* Called with IRQ disabled */
+static int push(unsigned char *b, unsigned char n)
+{
+	unsigned char h = head, x;
+
+	if((unsigned char)(LOG_SIZE - (unsigned char)(h - tail)) < n)
+		return -1;
+	for(x=0; x<n; x++)
+		ring[(h + x) & LOG_MASK] = b[x];
+	head = h + n;
+	return 0;
+}
+
+void log_msg(unsigned char id, long a, long b)
+{
+	unsigned char m[LOG_MSG_MAX], d[LOG_MSG_MAX];
+	unsigned char n, dn = 0;
+	OS_CPU_SR cpu_sr;
+
+	if(id >= LOG_NR)
+		return;
+	n = build(m, id, a, b) - m;
+
+	OS_ENTER_CRITICAL();
+	if(dropped){
+		dn = build(d, LOG_DROP, dropped, 0) - d;
+		if(!push(d, dn))
+			dropped = 0;
+	}
+	if(dropped || push(m, n))
+		dropped++;
+	OS_EXIT_CRITICAL();
+}
+
+static unsigned char put(unsigned char c)
+{
+	console_putc(c);
+	return c;
+}
+
+/* Management thread and osdie(); One frame with everything pending */
+void log_drain(void)
+{
+	unsigned char t = tail, n, x, sum;
+
+	n = head - t;
+	if(!n || console_tx_room() < n + 4) /* Whole frame or nothing */
+		return;
+
+	console_putc(LOG_SOF);
+	sum = put(LOG_TYPE);
+	sum += put(n);
+	for(x=0; x<n; x++)
+		sum += put(ring[(t + x) & LOG_MASK]);
+	put(sum);
+	console_flush();
+	tail = t + n;
+}
+
+#else
+#define LOG_FMT(id, n, fmt) fmt,
+static const char *log_fmt[LOG_NR] = {
+	LOG_TABLE(LOG_FMT)
+};
+
+void log_msg(unsigned char id, long a, long b)
+{
+	if(id >= LOG_NR)
+		return;
+	FORCE_PRINT(log_fmt[id], a, b);
+}
+#endif
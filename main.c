@@ -23,18 +23,9 @@ int trim_flag = 0;
 int timing_advance = 0, timing_advance_enabled = 0;
 int fuel_msec = 6;
 int record_mode = 0;
-volatile unsigned short capture_t;
+volatile unsigned long capture_t;
 volatile unsigned long curr_time;
 int engine_state;
-#ifdef __DWELL_TEST__
-volatile unsigned long T1, DWELL_DEBUG;
-#endif
-#ifdef __INJ_TEST__
-volatile unsigned long T2, INJ_DEBUG;
-#endif
-#ifdef __ADVANCE_TIMING_TEST__
-volatile unsigned long T1, TIMING_DEBUG;
-#endif
 
 /******************************************************************************/
 /* RTOS */
@@ -45,15 +36,12 @@ static OS_STK engine_thread_stack[STACK_SIZE];
 
 static int ON = 0;
 
-static void user_cmd(int *timing_advance, int *fuel_msec)
+static void user_cmd(int d, int *timing_advance, int *fuel_msec)
 {
-	int r, x, y;
-	unsigned char d;
+	int r;
 	unsigned long u;
+	static int trim_cyl = CYL1;
 
-	if(!USART_data_available())
-		return;
-	d = getchar();
 	switch (d) {
 	case 't':
 		trim_flag = 1;
@@ -95,19 +83,16 @@ static void user_cmd(int *timing_advance, int *fuel_msec)
 		break;
 	case 'r':
 		r = get_rpm();
-		u = deg_to_usec(10);
+		u = TICK_TO_USEC(deg_to_tick(10));
 		FORCE_PRINT("RPM %d:%ld\n",r,u);
 		break;
-#define PRIME_FUEL 17
 	case 'p':
-		PRINT("Prime injector\n");
-		for(y=0; y<4; y++){
-			io_open_injector(y+1);
-			for(x=0; x<PRIME_FUEL; x++)
-				DELAY_MSEC(1);
-			io_close_injector(y+1, 0);
+		if(prime_busy()){
+			prime_cancel();
+			FORCE_PRINT("Prime injector cancel\n");
 		}
-		PRINT("Prime injector done\n");
+		else if(!prime_start())
+			FORCE_PRINT("Prime injector %d:%d:%d:%d msec\n", prime_msec[0], prime_msec[1], prime_msec[2], prime_msec[3]);
 		break;
 	case 'o':
 		FORCE_PRINT("ON\n");
@@ -118,6 +103,53 @@ static void user_cmd(int *timing_advance, int *fuel_msec)
 		FORCE_PRINT("STARTER ON\n");
 		starter_on();
 		break;
+	case 'l':
+		if(closed_loop){
+			FORCE_PRINT("Closed loop OFF\n");
+			closed_loop = 0;
+		}
+		else{
+			FORCE_PRINT("Closed loop ON\n");
+			closed_loop = 1;
+		}
+		break;
+	case 'a':
+		if(reanchor_enabled){
+			FORCE_PRINT("Re-anchor OFF\n");
+			reanchor_enabled = 0;
+		}
+		else{
+			FORCE_PRINT("Re-anchor ON\n");
+			reanchor_enabled = 1;
+		}
+		break;
+	case 'f':
+		fuel_dump();
+		break;
+	case 'c':
+		trim_cyl = trim_cyl % CYL4 + 1;
+		FORCE_PRINT("CYL%d F %d T %d\n", trim_cyl, engine_get_fuel_trim(trim_cyl), engine_get_spark_trim(trim_cyl));
+		break;
+	case '}':
+	case '{':
+		r = engine_get_fuel_trim(trim_cyl);
+		if(d == '}' && r < 64)
+			r++;
+		if(d == '{' && r > -64)
+			r--;
+		engine_set_fuel_trim(trim_cyl, r);
+		FORCE_PRINT("CYL%d F %d\n", trim_cyl, r);
+		break;
+	case '>':
+	case '<':
+		r = engine_get_spark_trim(trim_cyl);
+		if(d == '>' && r < 5)
+			r++;
+		if(d == '<' && r > -5)
+			r--;
+		engine_set_spark_trim(trim_cyl, r);
+		FORCE_PRINT("CYL%d T %d\n", trim_cyl, r);
+		break;
 	case 'y':
 		if(record_mode)
 			record_mode = 0;
@@ -127,69 +159,184 @@ static void user_cmd(int *timing_advance, int *fuel_msec)
 
 	/* Stable and Trimmed */
 	case 'd':
-#ifdef __DWELL_TEST__
-		FORCE_PRINT("DWELL %ld\n", DWELL_DEBUG);
-#endif
-#ifdef __INJ_TEST__
-		FORCE_PRINT("INJ %ld\n", INJ_DEBUG);
-#endif
-#ifdef __ADVANCE_TIMING_TEST__
-		FORCE_PRINT("ADV %ld\n", TIMING_DEBUG);
-#endif
+		timerq_dump();
+		io_dump();
+		spark_dump();
+		console_dump();
+		break;
+	case 'h':
+		hist_dump();
 		break;
 	default:
 		break;
 	}
 }
 
-static void management_thread(void *p)
+/******************************************************************************/
+/* Management thread */
+/******************************************************************************/
+/*
+ * Sleeps on mgmt_event until something is posted or the next periodic job is due:
+ *	- MGMT_STATE from the engine thread on every engine_state change
+ *	- MGMT_RX from the UART RX IRQ when the ring goes non empty
+ * The time from the post to the action goes in HIST_ACTION.
+ * The console job polls the input on the platforms without an RX IRQ.
+ */
+struct job{
+	void (*fcn)(void);
+	unsigned long period;
+	unsigned long next;
+};
+
+static void job_wdt(void)
+{
+	wdt_reset();
+}
+
+static void job_pump(void)
+{
+	fuel_pump_update(ON);
+}
+
+static void job_log(void)
+{
+	toothlog_drain();
+	log_drain();
+}
+
+static void job_console(void)
+{
+	int c;
+
+	while((c = console_getc()) >= 0){
+		if(!proto_rx(c))
+			user_cmd(c, &timing_advance, &fuel_msec);
+	}
+}
+
+static struct job job[] = {
+	{ job_wdt, TICK_PER_MSEC * 100 },
+	{ adc_request_slow, TICK_PER_MSEC * 100 }, /* Slow sensors */
+	{ fuel_persist, TICK_PER_MSEC * 100 }, /* Learned fuel trim */
+	{ job_pump, TICK_PER_MSEC * 100 }, /* Gaz pump flow */
+	{ job_log, TICK_PER_MSEC * 20 }, /* Tooth log and deferred log to the UART */
+	{ job_console, TICK_PER_MSEC * 20 },
+};
+#define JOB_NR (sizeof(job) / sizeof(job[0]))
+
+static OS_EVENT *mgmt_event;
+static volatile unsigned char mgmt_pending;
+static unsigned long mgmt_post_t[MGMT_NR];
+
+/* Thread and IRQ context */
+void mgmt_post(unsigned char ev)
+{
+	OS_CPU_SR cpu_sr;
+	int post = 0;
+
+	OS_ENTER_CRITICAL();
+	if(!(mgmt_pending & (1 << ev))){
+		mgmt_pending |= 1 << ev;
+		mgmt_post_t[ev] = get_monotonic_tick();
+		post = 1;
+	}
+	OS_EXIT_CRITICAL();
+	if(post)
+		OSSemPost(mgmt_event);
+}
+
+static unsigned char mgmt_take(unsigned long *t)
 {
 	OS_CPU_SR cpu_sr;
-	int loop = 0;
+	unsigned char p;
+
+	OS_ENTER_CRITICAL();
+	p = mgmt_pending;
+	mgmt_pending = 0;
+	*t = mgmt_post_t[MGMT_STATE];
+	OS_EXIT_CRITICAL();
+	return p;
+}
+
+static void engine_transition(int state)
+{
+	switch(state){
+	case ENGINE_STOP:
+		LOG0(LOG_STOP);
+		break;
+	case ENGINE_INIT:
+		LOG0(LOG_INIT);
+		break;
+	case ENGINE_CRANK:
+		LOG0(LOG_CRANK);
+		break;
+	case ENGINE_RUN:
+		starter_off();
+		LOG1(LOG_RUN, time_to_start);
+		LOG0(LOG_STARTER_OFF);
+		break;
+	case ENGINE_DEAD:
+		LOG0(LOG_DEAD);
+		break;
+	}
+}
+
+/* OS tick up to the next job; At least one */
+static INT32U next_job(unsigned long now)
+{
+	unsigned long d, m = ~0UL;
+	unsigned int x;
+
+	for(x=0; x<JOB_NR; x++){
+		d = job[x].next - now;
+		if((long)d <= 0)
+			return 1;
+		if(d < m)
+			m = d;
+	}
+	return m / (TICK_PER_SEC / OS_TICKS_PER_SEC) + 1;
+}
+
+static void management_thread(void *p)
+{
 	int old_engine_state = -1;
+	unsigned char ev;
+	unsigned long now, t;
+	unsigned int x;
+	INT8U err;
 
 	watchdog_enable(WATCHDOG_250MS);
 	wdt_reset();
 
+	now = get_monotonic_tick();
+	for(x=0; x<JOB_NR; x++)
+		job[x].next = now;
+
 	while(1){
-		/* Feed the WD */
-		wdt_reset();
-
-		/* Run the User CLI */
-		user_cmd(&timing_advance, &fuel_msec);
-
-		/* Display transition */
-		if(engine_state != old_engine_state){
-			switch(engine_state){
-			case ENGINE_STOP:
-				FORCE_PRINT("STOP\n");
-				break;
-			case ENGINE_INIT:
-				FORCE_PRINT("INIT\n");
-				break;
-			case ENGINE_CRANK:
-				FORCE_PRINT("CRANK\n");
-				break;
-			case ENGINE_RUN:
-				FORCE_PRINT("RUN\n");
-				starter_off();
-				FORCE_PRINT("STARTER OFF\n");
-				break;
-			}
-		}
-		old_engine_state = engine_state;
-
-		if(!(loop%20)){
-			OS_ENTER_CRITICAL();
-			/* Duty cycle Gaz pump. Watch for read/modify/write against IRQ and high prioroty task */
-			if(ON)
-				gaz_toggle();
-			OS_EXIT_CRITICAL();
+		OSSemPend(mgmt_event, next_job(get_monotonic_tick()), &err);
+
+		ev = mgmt_take(&t);
+
+		/* Engine state transition */
+		if((ev & (1 << MGMT_STATE)) && engine_state != old_engine_state){
+			old_engine_state = engine_state;
+			engine_transition(old_engine_state);
+			hist_add(HIST_ACTION, get_monotonic_tick() - t);
 		}
 
-		loop++;
+		/* User CLI and tuning protocol right away */
+		if(ev & (1 << MGMT_RX))
+			job_console();
 
-		OSTimeDlyHMSM(0,0,0,100);
+		now = get_monotonic_tick();
+		for(x=0; x<JOB_NR; x++){
+			if((long)(now - job[x].next) < 0)
+				continue;
+			job[x].fcn();
+			job[x].next += job[x].period;
+			if((long)(now - job[x].next) >= 0) /* Fell behind; Don't catch up */
+				job[x].next = now + job[x].period;
+		}
 	}
 }
 
@@ -198,6 +345,15 @@ void osdie(int err, int line)
 	OS_CPU_SR cpu_sr;
 
 	OS_ENTER_CRITICAL();
+	/* Coils and injectors first; The drain below polls the UART for a few msec */
+	close_all_io();
+	/*
+	 * Polled with IRQs off; Before the 328 Nano branches back to RESET.
+	 * Drain first so that the DIE record has room even with a full ring.
+	 */
+	log_drain();
+	LOG2(LOG_DIE, err, line);
+	log_drain();
 #ifdef _BUG_328_NANO_
 	/* 
 	 * Clone 328 Nano bootloader doesn't clear the WD when coming up and keeps reloading evey 16msec
@@ -210,7 +366,6 @@ void osdie(int err, int line)
 	 */
 	wdt_reset();
 	watchdog_enable(WATCHDOG_2S);
-	fprintf(stderr, "DIE %d : %d\n", err, line);
 	{
 		/* timer1_disable */
 		unsigned char t;
@@ -220,8 +375,6 @@ void osdie(int err, int line)
 	}
 	__asm__ __volatile__ (  "jmp __ctors_end \n\t" );
 #endif
-	FORCE_PRINT("DIE %d : %d\n", err, line); 
-	close_all_io();
 	/* Wait for WD to reset */
 	while(1){};
 	OS_EXIT_CRITICAL();
@@ -238,8 +391,12 @@ int main(void)
 
 	lib_init();
 
+	console_init();
+
 	io_init();
 
+	timerq_init();
+
 #ifdef __UNIT_TEST__
 	unit_test();
 #endif
@@ -252,6 +409,7 @@ int main(void)
 	OSTaskCreate(engine_thread, NULL, &engine_thread_stack[STK_HEAD(STACK_SIZE)], 1);
 
 	engine_event = OSSemCreate(0);
+	mgmt_event = OSSemCreate(0);
 	
 	timer_init();
 
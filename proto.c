@@ -0,0 +1,364 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+
+/******************************************************************************/
+/* Tuning protocol */
+/******************************************************************************/
+/*
+ * Framed binary request / response next to the single character CLI; The SOF
+ * is not printable so it can't collide with a CLI command.
+ *	SOF SEQ CMD LEN { payload } CRC_LO CRC_HI
+ * CRC16-CCITT (0x1021, init 0xffff) over SEQ .. payload.
+ * The reply echoes SEQ and carries CMD | PROTO_REPLY with the status as the
+ * first byte of the payload. Multi byte values are little endian.
+ * See tools/ecu_tune.py.
+ *
+ * The frame is decoded one byte at a time as it comes out of the RX ring.
+ * A frame that stops for more than PROTO_TIMEOUT is dropped.
+ *
+ * Once a SOF is seen the bytes never go to the CLI until the line is quiet
+ * for PROTO_IDLE_GAP; After a frame, a framing error or a timeout everything
+ * up to the next SOF is thrown away. A frame cut by a bad LEN, a timeout or
+ * a lost SOF can't turn into CLI commands.
+ */
+#define PROTO_SOF 0xa6
+#define PROTO_REPLY 0x80
+#define PROTO_PAYLOAD_MAX 40
+#define PROTO_TIMEOUT USEC_TO_TICK(200000UL)
+#define PROTO_IDLE_GAP USEC_TO_TICK(1000000UL) /* Back to the CLI */
+
+enum proto_cmd{
+	CMD_PING = 1,
+	CMD_LIVE, /* Live data block */
+	CMD_PARAM_READ, /* id */
+	CMD_PARAM_WRITE, /* id value_lo value_hi */
+	CMD_TABLE_READ, /* table offset len */
+	CMD_TABLE_WRITE, /* table offset { data } */
+};
+
+enum proto_status{
+	STATUS_OK = 0,
+	STATUS_BAD_CMD,
+	STATUS_BAD_ARG,
+	STATUS_RANGE,
+};
+
+/*
+ * Tunables; X(id, variable, min, max). NOTE the host parses this table; One entry per line.
+ * The per cylinder trims follow at PARAM_FUEL_TRIM and PARAM_SPARK_TRIM.
+ */
+#define PARAM_TABLE(X) \
+	X(PARAM_ADVANCE, timing_advance, 0, 30) \
+	X(PARAM_ADVANCE_ON, timing_advance_enabled, 0, 1) \
+	X(PARAM_REANCHOR, reanchor_enabled, 0, 1) \
+	X(PARAM_FUEL_MSEC, fuel_msec, 0, 20) \
+	X(PARAM_CLOSED_LOOP, closed_loop, 0, 1) \
+	X(PARAM_TRIM, trim_flag, 0, 1) \
+	X(PARAM_RECORD, record_mode, 0, 1)
+
+#define PARAM_ID(id, v, min, max) id,
+enum param_id{
+	PARAM_TABLE(PARAM_ID)
+	PARAM_NR,
+	PARAM_FUEL_TRIM = 0x40, /* + cylinder - CYL1; 1/256 of the pulse */
+	PARAM_SPARK_TRIM = 0x44, /* + cylinder - CYL1; deg */
+	PARAM_PRIME = 0x48, /* + injector - CYL1; msec */
+};
+
+struct param{
+	int *v;
+	signed char min, max;
+};
+
+#define PARAM_ENTRY(id, var, lo, hi) { .v = &var, .min = lo, .max = hi },
+static const struct param param[PARAM_NR] = {
+	PARAM_TABLE(PARAM_ENTRY)
+};
+
+enum table_id{
+	TABLE_LTFT = 0,
+};
+
+enum rx_state{
+	RX_IDLE = 0, /* CLI */
+	RX_RESYNC, /* Tuning session; Wait for the next SOF */
+	RX_SEQ,
+	RX_CMD,
+	RX_LEN,
+	RX_DATA,
+	RX_CRC_LO,
+	RX_CRC_HI,
+};
+
+static unsigned char rx_state, seq, cmd, len, pos;
+static unsigned char data[PROTO_PAYLOAD_MAX];
+static unsigned short crc, rx_crc;
+static unsigned long last;
+static unsigned short bad_crc, bad_len;
+
+static unsigned short crc16(unsigned short c, unsigned char b)
+{
+	unsigned char x;
+
+	c ^= (unsigned short)b << 8;
+	for(x=0; x<8; x++)
+		c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+	return c;
+}
+
+/* Whole frame or nothing; The host retries on timeout */
+static void send(unsigned char *p, unsigned char n)
+{
+	unsigned short c = 0xffff;
+	unsigned char x;
+
+	if(console_tx_room() < n + 6)
+		return;
+	console_putc(PROTO_SOF);
+	c = crc16(c, seq);
+	console_putc(seq);
+	c = crc16(c, cmd | PROTO_REPLY);
+	console_putc(cmd | PROTO_REPLY);
+	c = crc16(c, n);
+	console_putc(n);
+	for(x=0; x<n; x++){
+		c = crc16(c, p[x]);
+		console_putc(p[x]);
+	}
+	console_putc(c);
+	console_putc(c >> 8);
+	console_flush();
+}
+
+static unsigned char *put16(unsigned char *p, unsigned short v)
+{
+	*p++ = v;
+	*p++ = v >> 8;
+	return p;
+}
+
+static int param_read(unsigned char id, int *v)
+{
+	if(id < PARAM_NR){
+		*v = *param[id].v;
+		return STATUS_OK;
+	}
+	if(id >= PARAM_FUEL_TRIM && id < PARAM_FUEL_TRIM + CYL4){
+		*v = engine_get_fuel_trim(id - PARAM_FUEL_TRIM + CYL1);
+		return STATUS_OK;
+	}
+	if(id >= PARAM_SPARK_TRIM && id < PARAM_SPARK_TRIM + CYL4){
+		*v = engine_get_spark_trim(id - PARAM_SPARK_TRIM + CYL1);
+		return STATUS_OK;
+	}
+	if(id >= PARAM_PRIME && id < PARAM_PRIME + CYL4){
+		*v = prime_msec[id - PARAM_PRIME];
+		return STATUS_OK;
+	}
+	return STATUS_BAD_ARG;
+}
+
+/* Same limits as the CLI */
+static int param_write(unsigned char id, int v)
+{
+	if(id < PARAM_NR){
+		if(v < param[id].min || v > param[id].max)
+			return STATUS_RANGE;
+		*param[id].v = v;
+		return STATUS_OK;
+	}
+	if(id >= PARAM_FUEL_TRIM && id < PARAM_FUEL_TRIM + CYL4){
+		if(v < -64 || v > 64)
+			return STATUS_RANGE;
+		engine_set_fuel_trim(id - PARAM_FUEL_TRIM + CYL1, v);
+		return STATUS_OK;
+	}
+	if(id >= PARAM_SPARK_TRIM && id < PARAM_SPARK_TRIM + CYL4){
+		if(v < -5 || v > 5)
+			return STATUS_RANGE;
+		engine_set_spark_trim(id - PARAM_SPARK_TRIM + CYL1, v);
+		return STATUS_OK;
+	}
+	if(id >= PARAM_PRIME && id < PARAM_PRIME + CYL4){
+		if(v < 0 || v > 50)
+			return STATUS_RANGE;
+		prime_msec[id - PARAM_PRIME] = v;
+		return STATUS_OK;
+	}
+	return STATUS_BAD_ARG;
+}
+
+/*
+ * Live data block
+ *	RPM(2) STATE(1) ADVANCE(1) FLAGS(1) PULSE usec(2) TOOTH usec(2)
+ *	TIME_TO_START msec(2) SYNC(2) NO_SYNC(2) STALL(2) MAP(2) EGO(2) BAD_CRC(2)
+ *	BAD_LEN(2)
+ */
+#define FLAG_ADVANCE 0x01
+#define FLAG_CLOSED_LOOP 0x02
+#define FLAG_REANCHOR 0x04
+#define FLAG_RECORD 0x08
+#define FLAG_TRIM 0x10
+
+static unsigned char *live(unsigned char *p)
+{
+	unsigned long tooth = trigger_wheel_next_period();
+
+	p = put16(p, tooth ? get_rpm() : 0);
+	*p++ = engine_state;
+	*p++ = timing_advance;
+	*p++ = (timing_advance_enabled ? FLAG_ADVANCE : 0) | (closed_loop ? FLAG_CLOSED_LOOP : 0) |
+		(reanchor_enabled ? FLAG_REANCHOR : 0) | (record_mode ? FLAG_RECORD : 0) |
+		(trim_flag ? FLAG_TRIM : 0);
+	p = put16(p, TICK_TO_USEC(fuel_pulse_tick(0)));
+	p = put16(p, TICK_TO_USEC(tooth));
+	p = put16(p, time_to_start);
+	p = put16(p, sync_nr);
+	p = put16(p, no_sync_nr);
+	p = put16(p, stall_nr);
+	p = put16(p, adc_get(ADC_MAP));
+	p = put16(p, adc_get(ADC_EGO));
+	p = put16(p, bad_crc);
+	p = put16(p, bad_len);
+	return p;
+}
+
+static void dispatch(void)
+{
+	unsigned char out[1 + PROTO_PAYLOAD_MAX], *p = out + 1;
+	int v = 0, n;
+
+	out[0] = STATUS_OK;
+	switch(cmd){
+	case CMD_PING:
+		memcpy(p, data, len);
+		p += len;
+		break;
+	case CMD_LIVE:
+		p = live(p);
+		break;
+	case CMD_PARAM_READ:
+		if(len != 1){
+			out[0] = STATUS_BAD_ARG;
+			break;
+		}
+		out[0] = param_read(data[0], &v);
+		*p++ = data[0];
+		p = put16(p, v);
+		break;
+	case CMD_PARAM_WRITE:
+		if(len != 3){
+			out[0] = STATUS_BAD_ARG;
+			break;
+		}
+		out[0] = param_write(data[0], (short)(data[1] | (data[2] << 8)));
+		param_read(data[0], &v);
+		*p++ = data[0];
+		p = put16(p, v);
+		break;
+	case CMD_TABLE_READ:
+		n = data[2];
+		if(len != 3 || data[0] != TABLE_LTFT || n > PROTO_PAYLOAD_MAX - 2 ||
+			fuel_table_read(data[1], (signed char *)p + 2, n) < 0){
+			out[0] = STATUS_BAD_ARG;
+			break;
+		}
+		*p++ = data[0];
+		*p++ = data[1];
+		p += n;
+		break;
+	case CMD_TABLE_WRITE:
+		if(len < 2 || data[0] != TABLE_LTFT ||
+			fuel_table_write(data[1], (signed char *)data + 2, len - 2) < 0){
+			out[0] = STATUS_BAD_ARG;
+			break;
+		}
+		*p++ = data[0];
+		*p++ = data[1];
+		*p++ = len - 2;
+		break;
+	default:
+		out[0] = STATUS_BAD_CMD;
+		break;
+	}
+	send(out, p - out);
+}
+
+/*
+ * Management thread; Returns 1 when the byte belongs to a frame, 0 when it's
+ * for the CLI.
+ */
+int proto_rx(unsigned char c)
+{
+	unsigned long now = get_monotonic_tick();
+
+	if(rx_state != RX_IDLE && now - last > PROTO_IDLE_GAP)
+		rx_state = RX_IDLE;
+	else if(rx_state > RX_RESYNC && now - last > PROTO_TIMEOUT)
+		rx_state = RX_RESYNC;
+	last = now;
+
+	switch(rx_state){
+	case RX_IDLE:
+	case RX_RESYNC:
+		if(c != PROTO_SOF)
+			return rx_state == RX_RESYNC;
+		crc = 0xffff;
+		rx_state = RX_SEQ;
+		break;
+	case RX_SEQ:
+		seq = c;
+		crc = crc16(crc, c);
+		rx_state = RX_CMD;
+		break;
+	case RX_CMD:
+		cmd = c;
+		crc = crc16(crc, c);
+		rx_state = RX_LEN;
+		break;
+	case RX_LEN:
+		len = c;
+		pos = 0;
+		crc = crc16(crc, c);
+		if(len > PROTO_PAYLOAD_MAX){ /* Framing error; Not a corrupted frame */
+			bad_len++;
+			rx_state = RX_RESYNC;
+			break;
+		}
+		rx_state = len ? RX_DATA : RX_CRC_LO;
+		break;
+	case RX_DATA:
+		data[pos++] = c;
+		crc = crc16(crc, c);
+		if(pos == len)
+			rx_state = RX_CRC_LO;
+		break;
+	case RX_CRC_LO:
+		rx_crc = c;
+		rx_state = RX_CRC_HI;
+		break;
+	case RX_CRC_HI:
+		rx_crc |= (unsigned short)c << 8;
+		rx_state = RX_RESYNC;
+		if(rx_crc != crc){
+			bad_crc++;
+			break;
+		}
+		dispatch();
+		break;
+	}
+	return 1;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+
+/*
+ * ECU timer queue for the coil and injector deadlines
+ *
+ * Sorted circular array; the head is the next deadline and is the only one
+ * programmed in the compare channel of the platform. Deadlines are mostly
+ * queued in order ( e.g. coil then injector of the next cylinder ) so the
+ * insertion scans from the tail and is O(1) in the common case. Pop is O(1).
+ *
+ * Deadlines are in timer tick.
+ * Everything is called with IRQ disabled OR from the compare IRQ.
+ *
+ * When the queue is full the callback runs right away; closing an output
+ * early is better than never closing it. This is counted as an overrun.
+ */
+#define TIMERQ_SIZE 16 /* Power of 2 */
+#define TIMERQ_MASK (TIMERQ_SIZE - 1)
+#define TIMERQ_LATE_TICK USEC_TO_TICK(20)
+
+struct timerq_entry{
+	unsigned long deadline;
+	work_t fcn;
+	unsigned char arg;
+	unsigned char edge; /* Output the platform can drive in HW; 0 when none */
+};
+
+static struct timerq_entry q[TIMERQ_SIZE];
+static unsigned char head, nr;
+static unsigned short late, overrun;
+static unsigned long late_max;
+
+#define Q(x) (&q[(head + (x)) & TIMERQ_MASK])
+
+void timerq_add(work_t fcn, int arg, unsigned long deadline, int edge)
+{
+	unsigned char x;
+	struct timerq_entry *e;
+
+	if(nr == TIMERQ_SIZE){
+		overrun++;
+		fcn(arg, get_monotonic_tick());
+		return;
+	}
+
+	/* Insertion from the tail; Usually nothing to move */
+	for(x = nr; x > 0; x--){
+		e = Q(x - 1);
+		if((long)(deadline - e->deadline) >= 0)
+			break;
+		*Q(x) = *e;
+	}
+	e = Q(x);
+	e->deadline = deadline;
+	e->fcn = fcn;
+	e->arg = arg;
+	e->edge = edge;
+	nr++;
+
+	if(x == 0) /* New head */
+		timerq_arm_platform(deadline, edge);
+}
+
+/*
+ * Remove a pending deadline; O(n) so not for the common case.
+ * If it was the head the compare fires for nothing and re-arms.
+ */
+void timerq_cancel(work_t fcn, int arg)
+{
+	unsigned char x;
+
+	for(x = 0; x < nr; x++){
+		if(Q(x)->fcn == fcn && Q(x)->arg == arg)
+			break;
+	}
+	if(x == nr)
+		return;
+	for(; x < nr - 1; x++)
+		*Q(x) = *Q(x + 1);
+	nr--;
+}
+
+/*
+ * Compare IRQ
+ */
+void timerq_expire(void)
+{
+	unsigned long now, l;
+	struct timerq_entry e;
+
+	now = get_monotonic_tick();
+	while(nr){
+		if((long)(Q(0)->deadline - now) > 0)
+			break;
+		e = *Q(0);
+		head = (head + 1) & TIMERQ_MASK;
+		nr--;
+
+		l = now - e.deadline;
+		if(l > TIMERQ_LATE_TICK)
+			late++;
+		if(l > late_max)
+			late_max = l;
+
+		e.fcn(e.arg, now);
+		now = get_monotonic_tick();
+	}
+	if(nr)
+		timerq_arm_platform(Q(0)->deadline, Q(0)->edge);
+}
+
+void timerq_dump(void)
+{
+	FORCE_PRINT("TIMERQ %d LATE %d:%ld OVERRUN %d\n", nr, late, TICK_TO_USEC(late_max), overrun);
+}
+
+void timerq_init(void)
+{
+	head = 0;
+	nr = 0;
+	late = 0;
+	late_max = 0;
+	overrun = 0;
+	timerq_init_platform();
+}
@@ -0,0 +1,300 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024, Etienne Martineau etienne4313@gmail.com
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+"""
+Client of the framed tuning protocol (see proto.c).
+
+  SOF SEQ CMD LEN { payload } CRC_LO CRC_HI    CRC16-CCITT over SEQ .. payload
+
+The tunables are taken from PARAM_TABLE in proto.c. Everything else on the
+line (CLI text, tooth log and deferred log frames) is skipped, or copied to
+stderr with --console. A request is retried when the reply doesn't show up.
+The ECU doesn't take CLI keystrokes until the line is quiet for 1 s after
+the last request.
+
+Example:
+  tools/ecu_tune.py /dev/ttyUSB0 live --rate 10
+  tools/ecu_tune.py /dev/ttyUSB0 get all
+  tools/ecu_tune.py /dev/ttyUSB0 set advance 12
+  tools/ecu_tune.py /dev/ttyUSB0 spark-trim 2 -1
+  tools/ecu_tune.py /dev/ttyUSB0 prime 1 25
+  tools/ecu_tune.py /dev/ttyUSB0 table-read > ltft.csv
+  tools/ecu_tune.py /dev/ttyUSB0 table-write ltft.csv
+"""
+import argparse
+import csv
+import os
+import re
+import select
+import struct
+import sys
+import termios
+import time
+import tty
+
+SOF = 0xa6
+REPLY = 0x80
+PAYLOAD_MAX = 40
+
+CMD_PING, CMD_LIVE, CMD_PARAM_READ, CMD_PARAM_WRITE, CMD_TABLE_READ, CMD_TABLE_WRITE = range(1, 7)
+STATUS = {0: "OK", 1: "BAD_CMD", 2: "BAD_ARG", 3: "RANGE"}
+PARAM_FUEL_TRIM = 0x40
+PARAM_SPARK_TRIM = 0x44
+PARAM_PRIME = 0x48
+TABLE_LTFT = 0
+LTFT_ROW = LTFT_COL = 8
+
+STATE = {0: "STOP", 1: "INIT", 2: "CRANK", 3: "RUN", 4: "DEAD"}
+LIVE = struct.Struct("<HBbBHHHHHHHHHH")
+LIVE_FIELDS = ("rpm", "state", "advance", "flags", "pulse_us", "tooth_us",
+               "time_to_start", "sync", "no_sync", "stall", "map", "ego", "bad_crc",
+               "bad_len")
+FLAGS = ((0x01, "ADV"), (0x02, "CL"), (0x04, "REANCHOR"), (0x08, "REC"), (0x10, "TRIM"))
+
+BAUD = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+        57600: termios.B57600, 115200: termios.B115200}
+
+
+def crc16(data, c=0xffff):
+    for b in data:
+        c ^= b << 8
+        for _ in range(8):
+            c = ((c << 1) ^ 0x1021) if c & 0x8000 else c << 1
+            c &= 0xffff
+    return c
+
+
+def load_params(source):
+    """ PARAM_TABLE(X) ==> {name: id} in id order """
+    names = []
+    inside = False
+    for line in open(source):
+        if line.startswith("#define PARAM_TABLE("):
+            inside = True
+            continue
+        if not inside:
+            continue
+        m = re.search(r"X\(\s*PARAM_(\w+)\s*,", line)
+        if m:
+            names.append(m.group(1).lower())
+        if not line.rstrip().endswith("\\"):
+            break
+    if not names:
+        sys.exit("%s: no PARAM_TABLE" % source)
+    return {n: i for i, n in enumerate(names)}
+
+
+class Link:
+    """ Raw tty, or any pair of file descriptors """
+
+    def __init__(self, port, baud, rfd=None, wfd=None):
+        if port is None:
+            self.rfd, self.wfd = rfd, wfd
+            return
+        fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+        if os.isatty(fd):
+            tty.setraw(fd)
+            attr = termios.tcgetattr(fd)
+            attr[4] = attr[5] = BAUD[baud]
+            termios.tcsetattr(fd, termios.TCSANOW, attr)
+        self.rfd = self.wfd = fd
+
+    def write(self, data):
+        os.write(self.wfd, data)
+
+    def read(self, timeout):
+        r, _, _ = select.select([self.rfd], [], [], timeout)
+        if not r:
+            return b""
+        return os.read(self.rfd, 256)
+
+
+class Ecu:
+    def __init__(self, link, console=None, timeout=0.3, retry=3):
+        self.link = link
+        self.console = console
+        self.timeout = timeout
+        self.retry = retry
+        self.seq = 0
+        self.buf = bytearray()
+        self.bad = 0
+
+    def frame(self, cmd, payload):
+        body = bytes([self.seq, cmd, len(payload)]) + bytes(payload)
+        c = crc16(body)
+        return bytes([SOF]) + body + bytes([c & 0xff, c >> 8])
+
+    def skip(self, n):
+        if self.console and n:
+            self.console.write(self.buf[:n].decode("latin-1"))
+            self.console.flush()
+        del self.buf[:n]
+
+    def replies(self):
+        """ Every complete reply in the buffer; Incremental like the ECU side """
+        while True:
+            i = self.buf.find(SOF)
+            if i < 0:
+                self.skip(len(self.buf))
+                return
+            self.skip(i)
+            if len(self.buf) < 4:
+                return
+            n = self.buf[3]
+            if n > PAYLOAD_MAX + 1 or not self.buf[2] & REPLY:
+                self.skip(1)
+                continue
+            if len(self.buf) < 4 + n + 2:
+                return
+            c = self.buf[4 + n] | self.buf[5 + n] << 8
+            if crc16(self.buf[1:4 + n]) != c:
+                self.bad += 1
+                self.skip(1)
+                continue
+            seq, cmd = self.buf[1], self.buf[2] & ~REPLY
+            payload = bytes(self.buf[4:4 + n])
+            del self.buf[:6 + n]
+            yield seq, cmd, payload
+
+    def request(self, cmd, payload=b""):
+        self.seq = (self.seq + 1) & 0xff
+        req = self.frame(cmd, payload)
+        for _ in range(self.retry):
+            self.link.write(req)
+            end = time.monotonic() + self.timeout
+            while time.monotonic() < end:
+                self.buf += self.link.read(max(0, end - time.monotonic()))
+                for seq, rcmd, reply in self.replies():
+                    if seq == self.seq and rcmd == cmd:
+                        if reply[0]:
+                            raise RuntimeError(STATUS.get(reply[0], reply[0]))
+                        return reply[1:]
+        raise TimeoutError("no reply to cmd %d" % cmd)
+
+    def ping(self, data=b"ECU"):
+        return self.request(CMD_PING, data) == data
+
+    def live(self):
+        return dict(zip(LIVE_FIELDS, LIVE.unpack(self.request(CMD_LIVE)[:LIVE.size])))
+
+    def param_read(self, pid):
+        r = self.request(CMD_PARAM_READ, bytes([pid]))
+        return struct.unpack_from("<h", r, 1)[0]
+
+    def param_write(self, pid, value):
+        r = self.request(CMD_PARAM_WRITE, bytes([pid]) + struct.pack("<h", value))
+        return struct.unpack_from("<h", r, 1)[0]
+
+    def table_read(self, table=TABLE_LTFT, size=LTFT_ROW * LTFT_COL, chunk=32):
+        out = []
+        for off in range(0, size, chunk):
+            n = min(chunk, size - off)
+            r = self.request(CMD_TABLE_READ, bytes([table, off, n]))
+            out += struct.unpack_from("<%db" % n, r, 2)
+        return out
+
+    def table_write(self, values, table=TABLE_LTFT, chunk=32):
+        for off in range(0, len(values), chunk):
+            part = values[off:off + chunk]
+            self.request(CMD_TABLE_WRITE, bytes([table, off]) + struct.pack("<%db" % len(part), *part))
+
+
+def show_live(d):
+    flags = "|".join(n for b, n in FLAGS if d["flags"] & b) or "-"
+    return ("RPM %5d %-5s ADV %2d %-16s PULSE %5d TOOTH %5d START %5d SYNC %d NOSYNC %d "
+            "STALL %d MAP %4d EGO %4d CRC %d LEN %d" % (
+                d["rpm"], STATE.get(d["state"], d["state"]), d["advance"], flags, d["pulse_us"],
+                d["tooth_us"], d["time_to_start"], d["sync"], d["no_sync"], d["stall"],
+                d["map"], d["ego"], d["bad_crc"], d["bad_len"]))
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    p = argparse.ArgumentParser(description=__doc__,
+                                formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("port")
+    p.add_argument("--baud", type=int, default=115200, choices=sorted(BAUD))
+    p.add_argument("--source", default=os.path.join(here, "..", "proto.c"),
+                   help="proto.c holding PARAM_TABLE")
+    p.add_argument("--console", action="store_true", help="copy the other traffic to stderr")
+    sub = p.add_subparsers(dest="cmd", required=True)
+    sub.add_parser("ping")
+    s = sub.add_parser("live")
+    s.add_argument("--rate", type=float, default=5, help="Hz")
+    s.add_argument("--count", type=int, default=0, help="0 is forever")
+    s = sub.add_parser("get")
+    s.add_argument("name", help="tunable or 'all'")
+    s = sub.add_parser("set")
+    s.add_argument("name")
+    s.add_argument("value", type=int)
+    for t in ("fuel-trim", "spark-trim"):
+        s = sub.add_parser(t)
+        s.add_argument("cyl", type=int, choices=range(1, 5), help="cylinder")
+        s.add_argument("value", type=int, nargs="?")
+    s = sub.add_parser("prime")
+    s.add_argument("inj", type=int, choices=range(1, 5), help="injector")
+    s.add_argument("msec", type=int, nargs="?", help="pulse of the 'p' command")
+    sub.add_parser("table-read")
+    s = sub.add_parser("table-write")
+    s.add_argument("csv", help="8 rows (RPM) of 8 cells (Load)")
+    args = p.parse_args()
+
+    params = load_params(args.source)
+    ecu = Ecu(Link(args.port, args.baud), sys.stderr if args.console else None)
+
+    if args.cmd == "ping":
+        print("OK" if ecu.ping() else "MISMATCH")
+    elif args.cmd == "live":
+        n = 0
+        try:
+            while not args.count or n < args.count:
+                print(show_live(ecu.live()), flush=True)
+                n += 1
+                time.sleep(1.0 / args.rate)
+        except KeyboardInterrupt:
+            pass
+    elif args.cmd == "get":
+        names = sorted(params, key=params.get) if args.name == "all" else [args.name]
+        for name in names:
+            if name not in params:
+                sys.exit("%s: unknown; one of %s" % (name, ", ".join(params)))
+            print("%s %d" % (name, ecu.param_read(params[name])))
+    elif args.cmd == "set":
+        if args.name not in params:
+            sys.exit("%s: unknown; one of %s" % (args.name, ", ".join(params)))
+        print("%s %d" % (args.name, ecu.param_write(params[args.name], args.value)))
+    elif args.cmd in ("fuel-trim", "spark-trim"):
+        pid = (PARAM_FUEL_TRIM if args.cmd == "fuel-trim" else PARAM_SPARK_TRIM) + args.cyl - 1
+        v = ecu.param_read(pid) if args.value is None else ecu.param_write(pid, args.value)
+        print("CYL%d %s %d" % (args.cyl, args.cmd, v))
+    elif args.cmd == "prime":
+        pid = PARAM_PRIME + args.inj - 1
+        v = ecu.param_read(pid) if args.msec is None else ecu.param_write(pid, args.msec)
+        print("INJ%d prime %d msec" % (args.inj, v))
+    elif args.cmd == "table-read":
+        t = ecu.table_read()
+        w = csv.writer(sys.stdout)
+        for r in range(LTFT_ROW):
+            w.writerow(t[r * LTFT_COL:(r + 1) * LTFT_COL])
+    elif args.cmd == "table-write":
+        rows = [[int(x) for x in row] for row in csv.reader(open(args.csv)) if row]
+        if len(rows) != LTFT_ROW or any(len(r) != LTFT_COL for r in rows):
+            sys.exit("%s: need %d rows of %d" % (args.csv, LTFT_ROW, LTFT_COL))
+        ecu.table_write([x for r in rows for x in r])
+        print("%d cells" % (LTFT_ROW * LTFT_COL))
+
+
+if __name__ == "__main__":
+    main()
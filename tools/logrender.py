@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024, Etienne Martineau etienne4313@gmail.com
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+"""
+Render the deferred log of the 328 build (see log.c).
+
+The ECU only sends the message id and the raw arguments; The formats are
+taken from LOG_TABLE in ecu.h so the table is the single source of truth.
+The plain text around the frames (CLI) is passed through as is so the output
+reads like the console of a text build. Frames of other type (tooth log) are
+skipped.
+
+Example:
+  stty -F /dev/ttyUSB0 115200 raw
+  tools/logrender.py /dev/ttyUSB0
+"""
+import argparse
+import os
+import re
+import sys
+
+SOF = 0xa5
+TYPE = ord("L")
+FRAME_TYPES = (ord("L"), ord("Z"))
+HDR = 2  # TYPE LEN
+
+ENTRY = re.compile(r'X\(\s*(\w+)\s*,\s*(\d+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)')
+
+
+def load_table(header):
+    """ LOG_TABLE(X) ==> [(name, nargs, python format)] in id order """
+    table = []
+    inside = False
+    for line in open(header):
+        if line.startswith("#define LOG_TABLE("):
+            inside = True
+            continue
+        if not inside:
+            continue
+        m = ENTRY.search(line)
+        if m:
+            fmt = m.group(3).encode().decode("unicode_escape")
+            fmt = re.sub(r"%(-?\d*)l+([dux])", r"%\1\2", fmt)
+            table.append((m.group(1), int(m.group(2)), fmt))
+        if not line.rstrip().endswith("\\"):
+            break
+    if not table:
+        sys.exit("%s: no LOG_TABLE" % header)
+    return table
+
+
+def zigzag(p, i):
+    v = s = 0
+    while True:
+        b = p[i]
+        i += 1
+        v |= (b & 0x7f) << s
+        s += 7
+        if not b & 0x80:
+            return (v >> 1) ^ -(v & 1), i
+
+
+def render(table, p, out):
+    i = 0
+    while i < len(p):
+        mid = p[i]
+        i += 1
+        if mid >= len(table):
+            out.write("LOG ?%d\n" % mid)
+            return  # Can't tell the length; Drop the rest of the frame
+        name, n, fmt = table[mid]
+        args = []
+        try:
+            for _ in range(n):
+                a, i = zigzag(p, i)
+                args.append(a)
+        except IndexError:
+            out.write("LOG %s truncated\n" % name)
+            return
+        out.write(fmt % tuple(args))
+
+
+def run(stream, table, out):
+    buf = bytearray()
+    while True:
+        chunk = stream.read(1) if stream.isatty() else stream.read(4096)
+        if not chunk:
+            break
+        buf += chunk
+        while True:
+            i = buf.find(SOF)
+            if i < 0:
+                out.write(buf.decode("latin-1"))
+                buf.clear()
+                break
+            if i:
+                out.write(buf[:i].decode("latin-1"))
+                del buf[:i]
+            if len(buf) < 1 + HDR:
+                break
+            size = 1 + HDR + buf[2] + 1
+            if buf[1] not in FRAME_TYPES:
+                out.write(chr(buf[0]))
+                del buf[0]
+                continue
+            if len(buf) < size:
+                break
+            if (sum(buf[1:size - 1]) & 0xff) != buf[size - 1]:
+                out.write(chr(buf[0]))
+                del buf[0]
+                continue
+            if buf[1] == TYPE:
+                render(table, bytes(buf[1 + HDR:size - 1]), out)
+            del buf[:size]
+        out.flush()
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    p = argparse.ArgumentParser(description=__doc__,
+                                formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("input", nargs="?", default="-",
+                   help="UART device or capture file (default stdin)")
+    p.add_argument("--header", default=os.path.join(here, "..", "ecu.h"),
+                   help="ecu.h holding LOG_TABLE")
+    args = p.parse_args()
+
+    table = load_table(args.header)
+    stream = sys.stdin.buffer if args.input == "-" else open(args.input, "rb")
+    try:
+        run(stream, table, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
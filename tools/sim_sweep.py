@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024, Etienne Martineau etienne4313@gmail.com
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+"""
+Calibration sweep of the X86_USER build against the engine plant.
+
+Every point of the grid is one ECU + plant process so each instance has its
+own copy of the globals and of the decoder / event / engine state; The
+processes are spread over all the cores. The plant is configured from the
+environment (see arch/x86/plant.c) and prints one "SIM key=value ..." line
+at the end of the run.
+
+Example:
+  tools/sim_sweep.py --bin ./subaru_ecu --advance 0:30:5 --fuel 4:10:2 \\
+      --noise 0,20 --profile 0:20 --profile 0:20,5:60 --repeat 3 --csv out.csv
+"""
+import argparse
+import csv
+import itertools
+import os
+import statistics
+import subprocess
+import sys
+from concurrent.futures import ThreadPoolExecutor, as_completed
+
+METRICS = ("time_to_start", "rpm_mean", "rpm_sd", "rpm_min", "rpm_max",
+           "fire", "misfire", "stall", "adv")
+
+
+def grid(spec):
+    """ "a:b:step" or "a,b,c" """
+    if ":" in spec:
+        a, b, s = (float(x) for x in spec.split(":"))
+        out = []
+        while a <= b + 1e-9:
+            out.append(a)
+            a += s
+        return out
+    return [float(x) for x in spec.split(",")]
+
+
+def run(args, point, seed):
+    env = dict(os.environ)
+    env.update({
+        "SIM_AUTOSTART": "1",
+        "SIM_DURATION": str(args.duration),
+        "SIM_SCALE": str(args.scale),
+        "SIM_ADVANCE": "%g" % point["advance"],
+        "SIM_FUEL": "%g" % point["fuel"],
+        "SIM_NOISE": "%g" % point["noise"],
+        "SIM_PROFILE": point["profile"],
+        "SIM_TRIM": "1" if args.trim else "0",
+        "SIM_SEED": str(seed),
+        "ECU_TRACE": os.devnull,
+    })
+    result = {"status": "ok"}
+    try:
+        p = subprocess.run([args.bin], env=env, stdin=subprocess.DEVNULL,
+                           stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                           timeout=args.duration / args.scale + args.timeout,
+                           universal_newlines=True)
+        out = p.stdout
+    except subprocess.TimeoutExpired as e:
+        out = e.stdout or ""
+        if isinstance(out, bytes):
+            out = out.decode(errors="replace")
+        result["status"] = "timeout"
+    for line in out.splitlines():
+        if line.startswith("DIE"):
+            result["status"] = "die " + line[4:].strip()
+        if line.startswith("SIM "):
+            for kv in line[4:].split():
+                k, v = kv.split("=")
+                result[k] = float(v)
+    if "fire" not in result and result["status"] == "ok":
+        result["status"] = "no report"
+    return result
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__,
+                                 formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--bin", required=True, help="X86_USER ECU binary")
+    ap.add_argument("--advance", default="10", help="deg; a:b:step OR a,b,c")
+    ap.add_argument("--fuel", default="6", help="msec; a:b:step OR a,b,c")
+    ap.add_argument("--noise", default="0", help="0.1%%; a:b:step OR a,b,c")
+    ap.add_argument("--profile", action="append",
+                    help="Throttle profile \"sec:%%,...\"; Repeat for more")
+    ap.add_argument("--trim", action="store_true", help="trim_to_sequential()")
+    ap.add_argument("--repeat", type=int, default=1, help="Runs per point")
+    ap.add_argument("--duration", type=float, default=10, help="Simulated sec")
+    ap.add_argument("--scale", type=int, default=1, help="SIM_SCALE")
+    ap.add_argument("--timeout", type=float, default=10, help="Extra wall sec")
+    ap.add_argument("--jobs", type=int, default=os.cpu_count())
+    ap.add_argument("--csv", help="One row per run")
+    args = ap.parse_args()
+
+    profiles = args.profile or ["0:20"]
+    points = [dict(advance=a, fuel=f, noise=n, profile=p)
+              for a, f, n, p in itertools.product(grid(args.advance), grid(args.fuel),
+                                                  grid(args.noise), profiles)]
+    runs = [(pt, r) for pt in points for r in range(args.repeat)]
+    print("%d points x %d = %d runs on %d jobs" % (len(points), args.repeat,
+                                                 len(runs), args.jobs), file=sys.stderr)
+
+    rows = []
+    with ThreadPoolExecutor(max_workers=args.jobs) as ex:
+        futures = {ex.submit(run, args, pt, r): (pt, r) for pt, r in runs}
+        for n, f in enumerate(as_completed(futures), 1):
+            pt, r = futures[f]
+            row = dict(pt, run=r)
+            row.update(f.result())
+            rows.append(row)
+            print("\r%d/%d" % (n, len(runs)), end="", file=sys.stderr)
+    print(file=sys.stderr)
+
+    if args.csv:
+        keys = ["advance", "fuel", "noise", "profile", "run", "status"] + list(METRICS)
+        with open(args.csv, "w", newline="") as fd:
+            w = csv.DictWriter(fd, fieldnames=keys, extrasaction="ignore")
+            w.writeheader()
+            for row in sorted(rows, key=lambda x: (x["advance"], x["fuel"], x["noise"],
+                                                   x["profile"], x["run"])):
+                w.writerow(row)
+
+    # Aggregate per point
+    print("%7s %5s %5s %-16s %4s %8s %8s %7s %7s %5s" % ("advance", "fuel", "noise",
+          "profile", "ok", "start", "rpm", "rpm_sd", "misfire", "stall"))
+    for pt in points:
+        rs = [x for x in rows if all(x[k] == pt[k] for k in pt)]
+        ok = [x for x in rs if x["status"] == "ok"]
+
+        def mean(k, only=None):
+            v = [x[k] for x in (only if only is not None else ok) if k in x and x[k] >= 0]
+            return statistics.mean(v) if v else float("nan")
+
+        print("%7g %5g %5g %-16s %2d/%-2d %8.0f %8.0f %7.1f %7.1f %5.1f" % (
+              pt["advance"], pt["fuel"], pt["noise"], pt["profile"], len(ok), len(rs),
+              mean("time_to_start"), mean("rpm_mean"), mean("rpm_sd"),
+              mean("misfire"), mean("stall")))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,454 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Cycle accurate benchmark of the mega328 firmware under simavr
+ *
+ * The firmware runs unmodified. PB0 is driven with the 36-2-2-2 crank
+ * waveform at a fixed RPM from simavr cycle timers, so the edges land on
+ * exact CPU cycles. Once the ECU reports ENGINE_RUN the bench measures:
+ *	- Every interrupt from its vector to the reti
+ *	- The functions given with -F from entry until the stack goes back
+ *	  above the entry SP, called from a thread or from an interrupt.
+ *	  Interrupts taken in the middle are subtracted.
+ *	- CPU load per engine cycle. The idle task and sleep count as idle.
+ * The last line is the worst case over all the RPM.
+ *
+ * Symbols come from "avr-nm -S --defined-only" since simavr doesn't expose
+ * the ELF symbol table in a stable way across versions.
+ *
+ * ./ecu_bench -f subaru_ecu.elf -s syms.txt -r 1000,3000,6000,7000 [-n cycles]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_core.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+
+#define F_CPU 16000000UL
+#define MCU "atmega328p"
+#define VECTOR_NR 26
+#define VECTOR_SIZE 4 /* jmp */
+#define OPCODE_RETI 0x9518
+#define ENGINE_RUN 3
+#define FCN_MAX 32
+#define DEPTH_MAX 8
+#define WARMUP_CYCLE 20 /* Engine cycle in RUN before measuring */
+
+static const char *vector_name[VECTOR_NR] = {
+	"RESET", "INT0", "INT1", "PCINT0", "PCINT1", "PCINT2", "WDT",
+	"TIMER2_COMPA", "TIMER2_COMPB", "TIMER2_OVF", "TIMER1_CAPT",
+	"TIMER1_COMPA", "TIMER1_COMPB", "TIMER1_OVF", "TIMER0_COMPA",
+	"TIMER0_COMPB", "TIMER0_OVF", "SPI_STC", "USART_RX", "USART_UDRE",
+	"USART_TX", "ADC", "EE_READY", "ANALOG_COMP", "TWI", "SPM_READY",
+};
+
+/* Measured by default */
+static const char *default_fcn[] = {
+	"run_trigger_wheel", "event_callback", "btdc_140", "btdc_40",
+	"btdc_10", "btdc_0", "timerq_expire", "timerq_add", "spark_reanchor",
+	"io_open_coil", "io_close_coil", "io_open_injector", "io_close_injector",
+};
+
+struct stat{
+	const char *name;
+	uint32_t addr;
+	unsigned long calls;
+	avr_cycle_count_t min, max, sum;
+};
+
+struct active{
+	struct stat *s;
+	avr_cycle_count_t start, isr_start;
+	uint16_t sp;
+};
+
+static struct stat isr[VECTOR_NR];
+static struct stat fcn[FCN_MAX];
+static int fcn_nr;
+static struct active stack[DEPTH_MAX];
+static int depth;
+
+static uint32_t idle_lo[2], idle_hi[2], engine_state_addr;
+static int in_isr = -1;
+static avr_cycle_count_t isr_start, isr_total;
+
+/* Load per engine cycle */
+static avr_cycle_count_t window_start, window_idle, window_len;
+static double load_max, load_sum;
+static unsigned long load_nr;
+static double worst_load;
+static int worst_rpm;
+static struct stat worst_isr, worst_fcn;
+
+/* Crank waveform */
+static avr_irq_t *crank;
+static avr_cycle_count_t slot_cycle;
+static int slot, measuring;
+static unsigned long engine_cycle, run_start;
+
+/******************************************************************************/
+/* Symbols */
+/******************************************************************************/
+struct sym{
+	char name[64];
+	uint32_t addr, size;
+	char type;
+};
+static struct sym *sym;
+static int sym_nr;
+
+static void load_syms(const char *file)
+{
+	FILE *f = fopen(file, "r");
+	char line[256];
+	struct sym s;
+
+	if(!f){
+		perror(file);
+		exit(1);
+	}
+	while(fgets(line, sizeof(line), f)){
+		if(sscanf(line, "%x %x %c %63s", &s.addr, &s.size, &s.type, s.name) != 4){
+			s.size = 0;
+			if(sscanf(line, "%x %c %63s", &s.addr, &s.type, s.name) != 3)
+				continue;
+		}
+		sym = realloc(sym, sizeof(*sym) * (sym_nr + 1));
+		sym[sym_nr++] = s;
+	}
+	fclose(f);
+}
+
+static struct sym *find_sym(const char *name)
+{
+	int x;
+
+	for(x=0; x<sym_nr; x++){
+		if(!strcmp(sym[x].name, name))
+			return &sym[x];
+	}
+	return NULL;
+}
+
+static void add_fcn(const char *name)
+{
+	struct sym *s = find_sym(name);
+
+	if(!s){
+		fprintf(stderr, "%s: not found, skipped\n", name);
+		return;
+	}
+	if(fcn_nr == FCN_MAX)
+		return;
+	fcn[fcn_nr].name = name;
+	fcn[fcn_nr].addr = s->addr; /* Text is at 0 so this is the byte PC */
+	fcn_nr++;
+}
+
+/******************************************************************************/
+/* Accounting */
+/******************************************************************************/
+static void stat_add(struct stat *s, avr_cycle_count_t c)
+{
+	if(!measuring)
+		return;
+	if(!s->calls || c < s->min)
+		s->min = c;
+	if(c > s->max)
+		s->max = c;
+	s->sum += c;
+	s->calls++;
+}
+
+static void stat_reset(void)
+{
+	int x;
+
+	for(x=0; x<VECTOR_NR; x++){
+		isr[x].calls = isr[x].sum = isr[x].max = isr[x].min = 0;
+		isr[x].name = vector_name[x];
+	}
+	for(x=0; x<fcn_nr; x++)
+		fcn[x].calls = fcn[x].sum = fcn[x].max = fcn[x].min = 0;
+	load_max = load_sum = 0;
+	load_nr = 0;
+}
+
+static uint16_t get_sp(avr_t *avr)
+{
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+static int is_idle(avr_t *avr)
+{
+	int x;
+
+	if(avr->state == cpu_Sleeping)
+		return 1;
+	for(x=0; x<2; x++){
+		if(avr->pc >= idle_lo[x] && avr->pc < idle_hi[x])
+			return 1;
+	}
+	return 0;
+}
+
+/* Called before every instruction */
+static void trace_pc(avr_t *avr)
+{
+	uint16_t opcode;
+	int x;
+
+	/* Hardware jumped to a vector */
+	if(in_isr < 0 && avr->pc > 0 && avr->pc < VECTOR_NR * VECTOR_SIZE && !(avr->pc % VECTOR_SIZE)){
+		in_isr = avr->pc / VECTOR_SIZE;
+		isr_start = avr->cycle;
+	}
+
+	if(in_isr >= 0){
+		opcode = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+		if(opcode == OPCODE_RETI){
+			/* Account the reti itself */
+			stat_add(&isr[in_isr], avr->cycle + 4 - isr_start);
+			isr_total += avr->cycle + 4 - isr_start;
+			in_isr = -1;
+		}
+	}
+
+	/*
+	 * Function returned; The stack is back above the entry SP.
+	 * Inside an interrupt isr_total doesn't move so nothing is subtracted.
+	 */
+	while(depth && get_sp(avr) > stack[depth - 1].sp){
+		struct active *a = &stack[--depth];
+		stat_add(a->s, (avr->cycle - a->start) - (isr_total - a->isr_start));
+	}
+
+	for(x=0; x<fcn_nr; x++){
+		if(avr->pc != fcn[x].addr || depth == DEPTH_MAX)
+			continue;
+		stack[depth].s = &fcn[x];
+		stack[depth].start = avr->cycle;
+		stack[depth].isr_start = isr_total;
+		stack[depth].sp = get_sp(avr);
+		depth++;
+	}
+}
+
+/******************************************************************************/
+/* Crank waveform */
+/******************************************************************************/
+/* Missing teeth 12,13 15,16 30,31 on both turns; Same layout as the plant */
+static int tooth_present(int s)
+{
+	s = s % 36;
+	return !(s == 12 || s == 13 || s == 15 || s == 16 || s == 30 || s == 31);
+}
+
+static avr_cycle_count_t crank_fall(avr_t *avr, avr_cycle_count_t when, void *p)
+{
+	avr_raise_irq(crank, 0);
+	return 0;
+}
+
+static avr_cycle_count_t crank_slot(avr_t *avr, avr_cycle_count_t when, void *p)
+{
+	slot = (slot + 1) % 72;
+	if(tooth_present(slot)){
+		avr_raise_irq(crank, 1);
+		avr_cycle_timer_register(avr, slot_cycle / 2, crank_fall, NULL);
+	}
+	if(!slot){
+		/* One engine cycle */
+		if(measuring && window_len){
+			double load = 1.0 - (double)window_idle / window_len;
+			if(load > load_max)
+				load_max = load;
+			load_sum += load;
+			load_nr++;
+		}
+		window_start = when;
+		window_idle = window_len = 0;
+		engine_cycle++;
+	}
+	return when + slot_cycle;
+}
+
+/******************************************************************************/
+/* Run */
+/******************************************************************************/
+static int engine_state(avr_t *avr)
+{
+	return avr->data[engine_state_addr];
+}
+
+static void report(int rpm)
+{
+	int x;
+	struct stat *s;
+
+	printf("\n@%d RPM: %lu engine cycle, load avg %.1f%% max %.1f%%\n", rpm, load_nr,
+		load_nr ? 100.0 * load_sum / load_nr : 0, 100.0 * load_max);
+	printf("%-20s %8s %8s %8s %8s %9s\n", "", "calls", "min", "avg", "max", "max usec");
+	for(x=0; x<VECTOR_NR + fcn_nr; x++){
+		s = (x < VECTOR_NR) ? &isr[x] : &fcn[x - VECTOR_NR];
+		if(!s->calls)
+			continue;
+		printf("%-20s %8lu %8llu %8llu %8llu %9.1f\n", s->name, s->calls,
+			(unsigned long long)s->min, (unsigned long long)(s->sum / s->calls),
+			(unsigned long long)s->max, s->max * 1e6 / F_CPU);
+		if(x < VECTOR_NR && s->max > worst_isr.max)
+			worst_isr = *s;
+		if(x >= VECTOR_NR && s->max > worst_fcn.max)
+			worst_fcn = *s;
+	}
+	if(load_max > worst_load){
+		worst_load = load_max;
+		worst_rpm = rpm;
+	}
+}
+
+static void report_worst(void)
+{
+	printf("\nWorst case: load %.1f%% @%d RPM; ISR %s %llu cycle; Function %s %llu cycle\n",
+		100.0 * worst_load, worst_rpm,
+		worst_isr.name ? worst_isr.name : "-", (unsigned long long)worst_isr.max,
+		worst_fcn.name ? worst_fcn.name : "-", (unsigned long long)worst_fcn.max);
+}
+
+static int bench(const char *firmware, int rpm, unsigned long cycles)
+{
+	elf_firmware_t fw;
+	avr_t *avr;
+	avr_cycle_count_t c;
+	int state, idle;
+
+	memset(&fw, 0, sizeof(fw));
+	if(elf_read_firmware(firmware, &fw)){
+		fprintf(stderr, "%s: can't load\n", firmware);
+		return -1;
+	}
+	strcpy(fw.mmcu, MCU);
+	fw.frequency = F_CPU;
+	avr = avr_make_mcu_by_name(fw.mmcu);
+	if(!avr)
+		return -1;
+	avr_init(avr);
+	avr_load_firmware(avr, &fw);
+
+	crank = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0);
+	avr_raise_irq(crank, 0);
+	slot_cycle = (F_CPU * 60UL) / ((unsigned long)rpm * 36);
+	slot = 0;
+	engine_cycle = run_start = 0;
+	depth = 0;
+	in_isr = -1;
+	isr_total = 0;
+	measuring = 0;
+	stat_reset();
+	/* Let the firmware come up */
+	avr_cycle_timer_register(avr, F_CPU / 2, crank_slot, NULL);
+
+	do{
+		if(!measuring && engine_state(avr) != ENGINE_RUN)
+			run_start = engine_cycle;
+		if(!measuring && engine_cycle - run_start >= WARMUP_CYCLE){
+			measuring = 1;
+			engine_cycle = 0;
+		}
+		trace_pc(avr);
+		idle = is_idle(avr);
+		c = avr->cycle;
+		state = avr_run(avr);
+		window_len += avr->cycle - c;
+		if(idle)
+			window_idle += avr->cycle - c;
+		if(measuring && engine_cycle >= cycles)
+			break;
+		/* Never got to RUN */
+		if(!measuring && avr->cycle > F_CPU * 20){
+			fprintf(stderr, "@%d RPM: no RUN after 20 sec (state %d)\n", rpm, engine_state(avr));
+			break;
+		}
+	}while(state != cpu_Done && state != cpu_Crashed);
+
+	report(rpm);
+	avr_terminate(avr);
+	return state == cpu_Crashed ? -1 : 0;
+}
+
+static void usage(const char *p)
+{
+	fprintf(stderr, "%s -f firmware.elf -s syms.txt [-r rpm,rpm] [-n engine_cycle] [-F fcn]...\n", p);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *firmware = NULL, *syms = NULL;
+	char *rpms = strdup("1000,3000,6000,7000"), *r;
+	unsigned long cycles = 100;
+	struct sym *s;
+	int c, x, user_fcn = 0, err = 0;
+	static const char *idle_sym[2] = { "OS_TaskIdle", "OSTaskIdleHook" };
+
+	while((c = getopt(argc, argv, "f:s:r:n:F:")) != -1){
+		switch(c){
+		case 'f': firmware = optarg; break;
+		case 's': syms = optarg; break;
+		case 'r': rpms = optarg; break;
+		case 'n': cycles = strtoul(optarg, NULL, 0); break;
+		case 'F':
+			if(!syms)
+				usage(argv[0]);
+			if(!sym_nr)
+				load_syms(syms);
+			add_fcn(optarg);
+			user_fcn = 1;
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if(!firmware || !syms)
+		usage(argv[0]);
+	if(!sym_nr)
+		load_syms(syms);
+	if(!user_fcn){
+		for(x=0; x<(int)(sizeof(default_fcn) / sizeof(default_fcn[0])); x++)
+			add_fcn(default_fcn[x]);
+	}
+
+	for(x=0; x<2; x++){
+		s = find_sym(idle_sym[x]);
+		if(s){
+			idle_lo[x] = s->addr;
+			idle_hi[x] = s->addr + s->size;
+		}
+	}
+	s = find_sym("engine_state");
+	if(!s){
+		fprintf(stderr, "engine_state: not found\n");
+		return 1;
+	}
+	engine_state_addr = s->addr & 0xffff; /* 0x800000 is the data space in the ELF */
+
+	for(r = strtok(rpms, ","); r; r = strtok(NULL, ","))
+		err |= bench(firmware, atoi(r), cycles);
+	report_worst();
+	return err ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024, Etienne Martineau etienne4313@gmail.com
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+"""
+Decode the compact tooth log ('y' on the CLI) out of the UART stream.
+
+Frames are picked out of whatever else is on the line and the tokens are
+turned back into the record_mode text i.e. one "period:average" line in usec
+per tooth (see toothlog.c for the format). Anything that isn't a valid frame
+is passed through to stderr. With --markers the decoder state, the events and
+the output edges are interleaved as '#' comments.
+
+At the end the compression against the text format and the raw 16 bit
+log (period + average) is reported along with the sustainable tooth rate
+at the given baud rate.
+
+Example:
+  stty -F /dev/ttyUSB0 115200 raw
+  tools/toothlog.py --markers /dev/ttyUSB0 > teeth.txt
+"""
+import argparse
+import sys
+
+SOF = 0xa5
+TYPE = ord("Z")
+HDR = 2  # TYPE LEN
+
+TOKEN_TOOTH = 0x00
+TOKEN_EVENT = 0x40
+TOKEN_OUTPUT = 0x80
+TOKEN_KEY = 0xc0
+TOKEN_STATE = 0xc1
+TOOTH_AVG = 0x20
+TOOTH_ESC = 31
+
+REAL_TOOTH_PER_TURN = 30
+RAW_TOOTH_BYTE = 4  # 16 bit period + 16 bit average
+OUTPUT_NAME = {1: "1", 2: "2", 3: "3", 4: "4", 5: "12", 6: "34"}
+
+
+def frames(stream, text, stats):
+    """ Yield the payload of every valid frame out of a byte stream """
+    buf = bytearray()
+    while True:
+        chunk = stream.read(1) if stream.isatty() else stream.read(4096)
+        if not chunk:
+            break
+        buf += chunk
+        while True:
+            i = buf.find(SOF)
+            if i < 0:
+                text.write(buf.decode("latin-1"))
+                buf.clear()
+                break
+            if i:
+                text.write(buf[:i].decode("latin-1"))
+                del buf[:i]
+            if len(buf) < 1 + HDR:
+                break
+            size = 1 + HDR + buf[2] + 1
+            if buf[1] != TYPE:
+                text.write(chr(buf[0]))
+                del buf[0]
+                continue
+            if len(buf) < size:
+                break
+            if (sum(buf[1:size - 1]) & 0xff) != buf[size - 1]:
+                stats["bad"] += 1
+                text.write(chr(buf[0]))
+                del buf[0]
+                continue
+            stats["wire"] += size
+            payload = bytes(buf[1 + HDR:size - 1])
+            del buf[:size]
+            yield payload
+
+
+class Decoder:
+    def __init__(self, out, markers):
+        self.out = out
+        self.markers = markers
+        self.avg = None  # No KEY yet
+        self.tooth = 0
+        self.lost = 0
+        self.text = 0
+
+    def emit(self, line):
+        self.out.write(line + "\n")
+
+    def marker(self, line):
+        if self.markers:
+            self.emit("# " + line)
+
+    @staticmethod
+    def varint(p, i):
+        v = s = 0
+        while True:
+            b = p[i]
+            i += 1
+            v |= (b & 0x7f) << s
+            s += 7
+            if not b & 0x80:
+                return v, i
+
+    @staticmethod
+    def zigzag(p, i):
+        v, i = Decoder.varint(p, i)
+        return (v >> 1) ^ -(v & 1), i
+
+    def frame(self, p):
+        i = 0
+        try:
+            while i < len(p):
+                tag = p[i]
+                i += 1
+                kind = tag & 0xc0
+                if tag == TOKEN_KEY:
+                    self.avg, i = self.varint(p, i)
+                    drop, i = self.varint(p, i)
+                    self.marker("KEY tooth %d" % p[i])
+                    i += 1
+                    if drop:
+                        self.lost += drop
+                        self.marker("DROP %d" % drop)
+                elif tag == TOKEN_STATE:
+                    self.marker("STATE %d" % p[i])
+                    i += 1
+                elif kind == TOKEN_TOOTH:
+                    z = tag & 0x1f
+                    if z == TOOTH_ESC:
+                        v, i = self.varint(p, i)
+                        z += v
+                    dp = (z >> 1) ^ -(z & 1)
+                    da = 0
+                    if tag & TOOTH_AVG:
+                        da, i = self.zigzag(p, i)
+                    if self.avg is None:
+                        continue  # Lost the chain; Wait for the next KEY
+                    self.avg += da
+                    line = "%d:%d" % (self.avg + dp, self.avg)
+                    self.text += len(line) + 1
+                    self.tooth += 1
+                    self.emit(line)
+                elif kind == TOKEN_EVENT:
+                    self.marker("EVENT %d @%d" % (tag & 0x3f, p[i] * 10))
+                    i += 1
+                else:
+                    t, i = self.varint(p, i)
+                    self.marker("%s%s %s +%d" % (
+                        "COIL" if tag & 0x10 else "INJ",
+                        OUTPUT_NAME.get(tag & 0xf, "?"),
+                        "ON" if tag & 0x20 else "OFF", t))
+        except IndexError:
+            self.avg = None  # Truncated token; Resync on KEY
+            self.marker("TRUNCATED")
+
+    def lost_frame(self):
+        self.avg = None
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__,
+                                formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("input", nargs="?", default="-",
+                   help="UART device or capture file (default stdin)")
+    p.add_argument("--markers", action="store_true",
+                   help="interleave state, event and output markers")
+    p.add_argument("--baud", type=int, default=115200)
+    args = p.parse_args()
+
+    stream = sys.stdin.buffer if args.input == "-" else open(args.input, "rb")
+    stats = {"wire": 0, "bad": 0}
+    dec = Decoder(sys.stdout, args.markers)
+    bad = 0
+    try:
+        for payload in frames(stream, sys.stderr, stats):
+            if stats["bad"] != bad:
+                bad = stats["bad"]
+                dec.lost_frame()
+            dec.frame(payload)
+            sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+
+    err = sys.stderr
+    print("# %d tooth %d lost %d bad frame" % (dec.tooth, dec.lost, stats["bad"]), file=err)
+    if not dec.tooth:
+        return
+    per_tooth = stats["wire"] / dec.tooth
+    rate = args.baud / 10 / per_tooth  # 8N1
+    print("# %.2f byte/tooth on the wire; text %.1f (x%.1f) raw %d (x%.1f)" % (
+        per_tooth, dec.text / dec.tooth, dec.text / stats["wire"],
+        RAW_TOOTH_BYTE, RAW_TOOTH_BYTE * dec.tooth / stats["wire"]), file=err)
+    print("# @%d baud: %d tooth/sec ==> %d RPM sustained" % (
+        args.baud, rate, rate * 60 / REAL_TOOTH_PER_TURN), file=err)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,199 @@
+/*
+ * Copyright 2024, Etienne Martineau etienne4313@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ecu.h>
+
+/******************************************************************************/
+/* Binary tooth logger */
+/******************************************************************************/
+/*
+ * Compact stream of token, see tools/toothlog.py
+ *
+ * The period of consecutive teeth barely moves so a tooth is coded as the
+ * zigzag difference to the running average; Small ones fit in the tag and most
+ * tooth are a single byte. The average is coded as the difference to the
+ * previous one only when it moved.
+ *	TOOTH	00addddd [v(zz - 31)] [zz(avg - prev avg)]
+ *		d: zz(period - avg) or 31 when it doesn't fit, a: the average moved
+ *	EVENT	01cccccc slot	c: cookie, slot: degree / 10
+ *	OUTPUT	10nciiii v(usec since the tooth)	n: on, c: coil, i: output group
+ *	KEY	11000000 v(avg) v(drop) tooth	Absolute average and token lost
+ *	STATE	11000001 state
+ * period / avg are in usec. A KEY goes out at start, after a drop and every
+ * engine cycle so the host can recover from a bad frame.
+ *
+ * Producers are the engine thread and the timer queue IRQ; A token is built
+ * on the stack then copied in the ring under critical section. head only moves
+ * by whole token and a frame carries everything pending so the frames are token
+ * aligned. When the ring is full the token is dropped and counted; The hot path
+ * never waits.
+ *
+ * Frame on the UART
+ *	SOF TYPE LEN { token } SUM
+ * SUM is the 8 bit sum of everything after SOF.
+ */
+#define TOOTHLOG_SIZE 128 /* Max with free running byte index */
+#define TOOTHLOG_MASK (TOOTHLOG_SIZE - 1)
+#define TOOTHLOG_FILL (TOOTHLOG_SIZE - 8) /* A whole frame fits the 128 B console TX ring */
+#define TOOTHLOG_SOF 0xa5
+#define TOOTHLOG_TYPE 'Z'
+#define TOOTHLOG_KEY_INTERVAL 60 /* Real teeth per engine cycle; 2 x ( 36 - 2 - 2 - 2 ) */
+#define TOKEN_MAX 12
+
+#define TOKEN_TOOTH 0x00
+#define TOKEN_EVENT 0x40
+#define TOKEN_OUTPUT 0x80
+#define TOKEN_KEY 0xc0
+#define TOKEN_STATE 0xc1
+#define TOOTH_AVG 0x20
+#define TOOTH_ESC 31
+#define OUTPUT_ON 0x20
+#define OUTPUT_COIL 0x10
+
+static unsigned char ring[TOOTHLOG_SIZE];
+static volatile unsigned char head, tail;
+static unsigned short dropped;
+static unsigned short prev_avg;
+static unsigned char prev_state = 0xff, key_ctr;
+
+static unsigned char *put_varint(unsigned char *p, unsigned long v)
+{
+	while(v >= 0x80){
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline unsigned long zigzag(long v)
+{
+	return v < 0 ? ((unsigned long)-v << 1) - 1 : (unsigned long)v << 1;
+}
+
+/* Called with IRQ disabled */
+static int push(unsigned char *b, unsigned char n)
+{
+	unsigned char h = head, x;
+
+	if((unsigned char)(TOOTHLOG_FILL - (unsigned char)(h - tail)) < n){
+		dropped++;
+		key_ctr = 0; /* Chain is broken; KEY on the next tooth */
+		return -1;
+	}
+	for(x=0; x<n; x++)
+		ring[(h + x) & TOOTHLOG_MASK] = b[x];
+	head = h + n;
+	return 0;
+}
+
+/* Engine thread */
+void toothlog_add(unsigned long t, unsigned long avg, unsigned char tooth, unsigned char state)
+{
+	unsigned char b[TOKEN_MAX], *p = b;
+	unsigned long z;
+	OS_CPU_SR cpu_sr;
+
+	t = TICK_TO_USEC(t);
+	avg = TICK_TO_USEC(avg);
+
+	OS_ENTER_CRITICAL();
+	if(!key_ctr){
+		*p++ = TOKEN_KEY;
+		p = put_varint(p, avg);
+		p = put_varint(p, dropped);
+		*p++ = tooth;
+		if(push(b, p - b))
+			goto out;
+		dropped = 0;
+		prev_avg = avg;
+		prev_state = 0xff;
+		p = b;
+	}
+	if(state != prev_state){
+		b[0] = TOKEN_STATE;
+		b[1] = state;
+		if(push(b, 2))
+			goto out;
+		prev_state = state;
+	}
+	z = zigzag((long)t - (long)avg);
+	*p = TOKEN_TOOTH | (avg != prev_avg ? TOOTH_AVG : 0);
+	if(z < TOOTH_ESC)
+		*p++ |= z;
+	else{
+		*p++ |= TOOTH_ESC;
+		p = put_varint(p, z - TOOTH_ESC);
+	}
+	if(avg != prev_avg)
+		p = put_varint(p, zigzag((long)avg - (long)prev_avg));
+	if(push(b, p - b))
+		goto out;
+	prev_avg = avg;
+	if(++key_ctr == TOOTHLOG_KEY_INTERVAL)
+		key_ctr = 0;
+out:
+	OS_EXIT_CRITICAL();
+}
+
+/* Engine thread */
+void toothlog_event(unsigned char cookie, unsigned char slot)
+{
+	unsigned char b[2];
+	OS_CPU_SR cpu_sr;
+
+	b[0] = TOKEN_EVENT | (cookie & 0x3f);
+	b[1] = slot;
+	OS_ENTER_CRITICAL();
+	push(b, 2);
+	OS_EXIT_CRITICAL();
+}
+
+/* Engine thread and timer queue IRQ */
+void toothlog_output(unsigned char id, int coil, int on)
+{
+	unsigned char b[TOKEN_MAX], *p = b;
+	OS_CPU_SR cpu_sr;
+
+	*p++ = TOKEN_OUTPUT | (on ? OUTPUT_ON : 0) | (coil ? OUTPUT_COIL : 0) | (id & 0xf);
+	p = put_varint(p, TICK_TO_USEC(get_monotonic_tick() - curr_time));
+	OS_ENTER_CRITICAL();
+	push(b, p - b);
+	OS_EXIT_CRITICAL();
+}
+
+static unsigned char put(unsigned char c)
+{
+	console_putc(c);
+	return c;
+}
+
+/* Management thread; One frame with everything pending */
+void toothlog_drain(void)
+{
+	unsigned char t = tail, n, x, sum;
+
+	n = head - t;
+	if(!n || console_tx_room() < n + 4) /* Whole frame or nothing */
+		return;
+
+	console_putc(TOOTHLOG_SOF);
+	sum = put(TOOTHLOG_TYPE);
+	sum += put(n);
+	for(x=0; x<n; x++)
+		sum += put(ring[(t + x) & TOOTHLOG_MASK]);
+	put(sum);
+	console_flush();
+	tail = t + n; /* Slots are free once sent */
+}
@@ -66,6 +66,44 @@ static void relay_test(void)
 	io_relay_off();
 }
 
+/*
+ * Timer queue stress @6000RPM: 4 coils and 4 injectors pending at once
+ *	720deg ==> 20msec; TDC every 5msec; Spark @10deg BTDC; 6msec injector
+ * IRQ are still disabled here so the queue is polled
+ */
+static int timerq_ctr;
+static void timerq_work(int arg, unsigned long t)
+{
+	timerq_ctr++;
+}
+
+static void timerq_test(void)
+{
+	int x, y, c;
+	unsigned long t, start, add = 0, expire = 0;
+
+	FORCE_PRINT( "Timer queue @6000RPM\n");
+	for(y=0; y<100; y++){
+		timerq_ctr = 0;
+		t = get_monotonic_tick() + USEC_TO_TICK(1000UL);
+		start = get_monotonic_tick();
+		for(x=0; x<4; x++){
+			timerq_add(timerq_work, CYL1 + x, t + USEC_TO_TICK(x * 5000UL) - USEC_TO_TICK(278UL), 0);
+			timerq_add(timerq_work, CYL1 + x, t + USEC_TO_TICK(x * 5000UL) + USEC_TO_TICK(6000UL), 0);
+		}
+		add += get_monotonic_tick() - start;
+		while(timerq_ctr < 8){
+			c = timerq_ctr;
+			start = get_monotonic_tick();
+			timerq_expire();
+			if(c != timerq_ctr)
+				expire += get_monotonic_tick() - start;
+		}
+	}
+	FORCE_PRINT( "ADD %ld EXPIRE %ld usec per cycle\n", TICK_TO_USEC(add / 100), TICK_TO_USEC(expire / 100));
+	timerq_dump();
+}
+
 static void full_sequence(void)
 {
 	FORCE_PRINT( "Full UT\n");
@@ -132,6 +170,9 @@ again:
 		case 'd':
 			coil_test(4);
 			break;
+		case 'q':
+			timerq_test();
+			break;
 		case 'x':
 			watchdog_enable(WATCHDOG_2S); /* Set the WD back to original setting before leaving UT */
 			wdt_reset();